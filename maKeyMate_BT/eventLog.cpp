@@ -0,0 +1,92 @@
+/*
+  eventLog.cpp
+ 
+ Definition for eventLogClass class. Events are written into a ring with
+ a micros() timestamp and sent out later by drain(), so recording costs a
+ few microseconds and never waits on the USB host. There's one writer
+ (record) and one reader (drain), each owning its own index, so neither
+ needs to disable interrupts.
+ 
+ drain() sends each record as 9 bytes:
+   0xA5, type, id, data (2 bytes), time (4 bytes), little endian
+ */
+#include "Arduino.h"
+#include "eventLog.h"
+
+eventLogClass eventLog;
+
+/* eventLogClass constructor
+ starts with an empty ring */
+eventLogClass::eventLogClass()
+{
+  head = 0;
+  tail = 0;
+  dropped = 0;
+}
+
+/* record(type, id, data)
+   Adds an event to the ring, timestamped now. If the ring is full the
+   event is counted as dropped, and reported by the next drain(). */
+void eventLogClass::record(byte type, byte id, unsigned int data)
+{
+  byte next = (head + 1) & (EVENT_LOG_SIZE - 1);
+
+  if (next == tail)
+  {
+    dropped++;
+    return;
+  }
+
+  records[head].time = micros();
+  records[head].type = type;
+  records[head].id = id;
+  records[head].data = data;
+  head = next;  // publish the record only once it's complete
+}
+
+/* drain(out, maxRecords)
+   Sends up to maxRecords events to out (usually Serial) and removes them
+   from the ring. Returns the number of records sent. */
+byte eventLogClass::drain(Print &out, byte maxRecords)
+{
+  byte count = 0;
+
+  if (dropped)
+  {
+    eventRecord lost;
+    lost.time = micros();
+    lost.type = EVENT_DROPPED;
+    lost.id = 0;
+    lost.data = dropped;
+    dropped = 0;
+    send(out, &lost);
+    count++;
+  }
+
+  while ((tail != head) && (count < maxRecords))
+  {
+    send(out, &records[tail]);
+    tail = (tail + 1) & (EVENT_LOG_SIZE - 1);
+    count++;
+  }
+
+  return count;
+}
+
+/* send(out, rec)
+   Writes a single record in the binary format described above. */
+void eventLogClass::send(Print &out, eventRecord * rec)
+{
+  byte frame[9];
+
+  frame[0] = EVENT_LOG_SYNC;
+  frame[1] = rec->type;
+  frame[2] = rec->id;
+  frame[3] = rec->data & 0xFF;
+  frame[4] = rec->data >> 8;
+  frame[5] = rec->time & 0xFF;
+  frame[6] = (rec->time >> 8) & 0xFF;
+  frame[7] = (rec->time >> 16) & 0xFF;
+  frame[8] = (rec->time >> 24) & 0xFF;
+  out.write(frame, 9);
+}
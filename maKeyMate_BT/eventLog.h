@@ -0,0 +1,79 @@
+/*
+  eventLog.h
+ 
+ Definition for eventLogClass class, a fixed-size ring of timestamped
+ input and report events, and the LOG_ERROR/LOG_INFO/LOG_DEBUG macros
+ that put log messages in the same ring.
+ */
+
+#ifndef eventLog_H
+#define eventLog_H
+
+#define EVENT_LOG_SIZE  32    // records in the ring, must be a power of 2
+#define EVENT_LOG_SYNC  0xA5  // first byte of every record sent by drain()
+
+// log levels, each includes the ones above it
+#define LOG_LEVEL_NONE   0
+#define LOG_LEVEL_ERROR  1
+#define LOG_LEVEL_INFO   2
+#define LOG_LEVEL_DEBUG  3
+
+#define LOG_LEVEL  LOG_LEVEL_INFO  // log messages above this level compile away completely
+
+// event types
+#define EVENT_PRESS    1  // id: input number
+#define EVENT_RELEASE  2  // id: input number
+#define EVENT_REPORT   3  // id: 0xFE keyboard or 0xFD mouse, data: modifiers/buttons | first key/x << 8
+#define EVENT_OVERRUN  4  // id: samples skipped (up to 255), data: microseconds late a sample was taken
+#define EVENT_DROPPED  5  // data: records lost because the ring was full
+#define EVENT_CONTACT  6  // id: input number, data: microseconds from contact edge to fast attack press
+#define EVENT_LOG_ERROR  7  // id: message code, data: message value (codes are in makeyMate.h)
+#define EVENT_LOG_INFO   8
+#define EVENT_LOG_DEBUG  9
+
+typedef struct {
+  unsigned long time;  // micros() when the event happened
+  byte type;
+  byte id;
+  unsigned int data;
+} 
+eventRecord;
+
+class eventLogClass
+{
+private:
+  eventRecord records[EVENT_LOG_SIZE];
+  volatile byte head;  // next record to write, only changed by record()
+  volatile byte tail;  // next record to send, only changed by drain()
+  unsigned int dropped;
+  void send(Print &out, eventRecord * rec);
+
+public:
+  eventLogClass();
+  void record(byte type, byte id, unsigned int data);
+  byte drain(Print &out, byte maxRecords);
+};
+
+extern eventLogClass eventLog;
+
+/* LOG_xxx(code, data) records a log message. Messages above LOG_LEVEL
+ compile to nothing, data isn't even evaluated. */
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(code, data)  eventLog.record(EVENT_LOG_ERROR, code, data)
+#else
+#define LOG_ERROR(code, data)  do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(code, data)   eventLog.record(EVENT_LOG_INFO, code, data)
+#else
+#define LOG_INFO(code, data)   do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(code, data)  eventLog.record(EVENT_LOG_DEBUG, code, data)
+#else
+#define LOG_DEBUG(code, data)  do {} while (0)
+#endif
+
+#endif	// eventLog_H
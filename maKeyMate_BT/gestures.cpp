@@ -0,0 +1,135 @@
+/*
+  gestures.cpp
+ 
+ Definition for gestureClass class. This class recognizes the sequences
+ and chords listed in settings.h. Each gesture is turned into a small
+ state machine in begin(), so a press doesn't depend on how many presses
+ came before. A mismatch can step back through a few fallbacks, but never
+ more than the steps matched so far, so a press costs about one step per
+ gesture on average. The fallback table takes GESTURE_MAX_LENGTH bytes per
+ gesture of SRAM, where a full state x input table would take 9 times that.
+ */
+#include "Arduino.h"
+#include "gestures.h"
+
+/* gestureClass constructor
+ starts with no gestures to recognize */
+gestureClass::gestureClass()
+{
+  list = 0;
+  count = 0;
+}
+
+/* begin(gestureList, gestureCount)
+   Builds the state machines for each gesture in the list. For sequences
+   this is the fallback table: how many steps are still matched after a
+   mismatch at each step (so u->u->d still finds u->d). For chords it's the
+   bit mask of member inputs. Extra gestures beyond GESTURE_MAX_COUNT are 
+   ignored. */
+void gestureClass::begin(const gesture * gestureList, byte gestureCount)
+{
+  list = gestureList;
+  count = min(gestureCount, GESTURE_MAX_COUNT);
+
+  for (byte g=0; g<count; g++)
+  {
+    progress[g] = 0;
+    held[g] = 0;
+    chordMask[g] = 0;
+    lastTime[g] = 0;
+
+    if (list[g].type == GESTURE_CHORD)
+    {
+      for (byte i=0; i<list[g].length; i++)
+      {
+        chordMask[g] |= (1UL << list[g].steps[i]);
+      }
+    }
+    else
+    {
+      byte k = 0;
+      fallback[g][0] = 0;
+      for (byte i=1; i<list[g].length; i++)
+      {
+        while ((k > 0) && (list[g].steps[i] != list[g].steps[k]))
+        {
+          k = fallback[g][k - 1];
+        }
+        if (list[g].steps[i] == list[g].steps[k])
+        {
+          k++;
+        }
+        fallback[g][i] = k;
+      }
+    }
+  }
+}
+
+/* press(input, now)
+   Feeds a newly pressed input through every gesture. now is the time of
+   the press in ms. Returns the action of a gesture that just completed,
+   or GESTURE_NONE. */
+byte gestureClass::press(byte input, unsigned long now)
+{
+  byte action = GESTURE_NONE;
+
+  for (byte g=0; g<count; g++)
+  {
+    const gesture * gest = &list[g];
+
+    if (gest->type == GESTURE_CHORD)
+    {
+      if (!(chordMask[g] & (1UL << input)))
+      {
+        continue;  // not part of this chord
+      }
+      if ((held[g] == 0) || (now - lastTime[g] > gest->timeout))
+      {
+        held[g] = 0;  // start a new window with this press
+        lastTime[g] = now;
+      }
+      held[g] |= (1UL << input);
+      if (held[g] == chordMask[g])
+      {
+        held[g] = 0;
+        action = gest->action;
+      }
+    }
+    else
+    {
+      byte k = progress[g];
+      if ((k > 0) && (now - lastTime[g] > gest->timeout))
+      {
+        k = 0;  // too slow, start over
+      }
+      while ((k > 0) && (gest->steps[k] != input))
+      {
+        k = fallback[g][k - 1];
+      }
+      if (gest->steps[k] == input)
+      {
+        k++;
+        lastTime[g] = now;
+      }
+      if (k == gest->length)
+      {
+        k = 0;
+        action = gest->action;
+      }
+      progress[g] = k;
+    }
+  }
+
+  return action;
+}
+
+/* release(input)
+   A released input drops out of any chord it was part of. Sequences 
+   don't care about releases. */
+void gestureClass::release(byte input)
+{
+  for (byte g=0; g<count; g++)
+  {
+    held[g] &= ~(1UL << input);
+  }
+}
@@ -0,0 +1,50 @@
+/*
+  gestures.h
+ 
+ Definition for gestureClass class, and the gesture struct used to list
+ gestures in settings.h.
+ */
+
+#ifndef gestures_H
+#define gestures_H
+
+#define GESTURE_MAX_COUNT   4  // most gestures that can be listed in settings.h
+#define GESTURE_MAX_LENGTH  6  // most inputs in a single gesture
+
+// gesture types
+#define GESTURE_SEQUENCE  0  // inputs pressed one after another, in order
+#define GESTURE_CHORD     1  // inputs held down together, in any order
+
+// gesture actions, returned by press() when a gesture completes
+#define GESTURE_NONE       0
+#define GESTURE_RECONNECT  1  // attempt to connect to the stored remote address
+#define GESTURE_NEXT_LAYER 2  // switch to the next keyCodes layer
+
+typedef struct {
+  byte type;  // GESTURE_SEQUENCE or GESTURE_CHORD
+  byte action;  // GESTURE_RECONNECT, etc.
+  unsigned int timeout;  // ms allowed between steps (sequence), or from first to last press (chord)
+  byte length;  // number of inputs in steps
+  byte steps[GESTURE_MAX_LENGTH];  // input numbers, 0-17
+} 
+gesture;
+
+class gestureClass
+{
+private:
+  const gesture * list;
+  byte count;
+  byte fallback[GESTURE_MAX_COUNT][GESTURE_MAX_LENGTH];  // sequence mismatch fallbacks
+  byte progress[GESTURE_MAX_COUNT];  // sequences: matched steps so far
+  unsigned long chordMask[GESTURE_MAX_COUNT];  // chords: one bit per member input
+  unsigned long held[GESTURE_MAX_COUNT];  // chords: members pressed inside the window
+  unsigned long lastTime[GESTURE_MAX_COUNT];  // time of the last matched press
+
+public:
+  gestureClass();
+  void begin(const gesture * gestureList, byte gestureCount);
+  byte press(byte input, unsigned long now);
+  void release(byte input);
+};
+
+#endif	// gestures_H
@@ -0,0 +1,281 @@
+/*
+  inputFilter.h
+
+ Definition for inputFilterClass class, the sample buffers, running sums
+ and press/release decisions behind every input.
+
+ Nothing in here touches the pins or the Arduino core, so the same
+ kernels can be built on a PC and checked against recorded samples.
+ Everything is defined in this header so the FILTER_MODE and FAST_ATTACK
+ settings still compile unused code away. Before including it, define:
+ BUFFER_LENGTH, FILTER_MODE, COMB_WINDOW and FAST_ATTACK, and
+ FAST_ATTACK_CONFIRM if FAST_ATTACK is on (see maKeyMate_BT.ino and 
+ settings.h).
+ */
+
+#ifndef inputFilter_H
+#define inputFilter_H
+
+#include <stdint.h>
+
+// filter modes, see FILTER_MODE in settings.h
+#define FILTER_WINDOW       0
+#define FILTER_COMB         1
+
+#if !defined(BUFFER_LENGTH) || !defined(FILTER_MODE) || !defined(COMB_WINDOW) || !defined(FAST_ATTACK)
+#error "define BUFFER_LENGTH, FILTER_MODE, COMB_WINDOW and FAST_ATTACK before including inputFilter.h"
+#endif
+
+#if FAST_ATTACK && !defined(FAST_ATTACK_CONFIRM)
+#error "define FAST_ATTACK_CONFIRM before including inputFilter.h"
+#endif
+
+#if (FILTER_MODE == FILTER_COMB) && ((COMB_WINDOW < 1) || (COMB_WINDOW >= BUFFER_LENGTH * 4))
+#error "COMB_WINDOW must be between 1 and 11"
+#endif
+
+// FILTER_COMB taps into the measurement buffers, relative to the newest sample
+#define COMB_DELAY  (BUFFER_LENGTH * 4)  // half a mains cycle, in samples
+
+// FAST_ATTACK: samples a contact has to settle into FAST_ATTACK_CONFIRM closed
+// in a row, counted from its first closed sample
+#define FAST_ATTACK_SETTLE  (BUFFER_LENGTH * 4)
+
+typedef struct {
+  uint8_t measurementBuffer[BUFFER_LENGTH];  // one bit per sample, 1 = closed
+  uint8_t oldestMeasurement;  // the sample the newest one overwrote
+  uint8_t bufferSum;  // closed samples in measurementBuffer
+  uint8_t combSum;  // FILTER_COMB: sum of the last COMB_WINDOW sample pairs, half a mains cycle apart
+  uint8_t closedRun;  // FAST_ATTACK: consecutive closed samples, up to 255
+  uint8_t confirmed;  // FAST_ATTACK: the window has seen the current press
+  uint8_t sincePress;  // FAST_ATTACK: samples since the press, up to 255
+  uint8_t sinceContact;  // FAST_ATTACK: samples since the first closed one after a quiet mains cycle, up to 255
+}
+filterState;
+
+class inputFilterClass
+{
+private:
+  uint8_t byteCounter;
+  uint8_t bitCounter;
+  uint8_t combTapByte[3];  // half a cycle ago, COMB_WINDOW ago, and COMB_WINDOW + half a cycle ago
+  uint8_t combTapBit[3];
+  int pressThreshold;
+  int releaseThreshold;
+  int combPressThreshold;
+
+  void updateCombTaps();
+
+public:
+  void begin(int offsetPerc, int centerBias, int combMarginPerc);
+  void reset(filterState * f);
+  void store(filterState * f, uint8_t closed);
+  void sum(filterState * f);
+  void advance();
+  void markPressed(filterState * f);
+  bool fastAttackDetected(const filterState * f);
+  bool pressDetected(const filterState * f);
+  bool releaseDetected(const filterState * f);
+};
+
+/* Works out the thresholds from the NOISE CANCELLATION settings (see 
+ settings.h) and starts the buffers over at the first sample. */
+inline void inputFilterClass::begin(int offsetPerc, int centerBias, int combMarginPerc)
+{
+  float pressThresholdAmount = (BUFFER_LENGTH * 8) * (offsetPerc / 100.0);
+  float thresholdCenter = ( (BUFFER_LENGTH * 8) / 2.0 ) * (centerBias / 50.0);
+  pressThreshold = int(thresholdCenter + pressThresholdAmount);
+  releaseThreshold = int(thresholdCenter - pressThresholdAmount);
+  // the comb sums 2 x COMB_WINDOW samples, centered with the same bias as 
+  // the window, plus the margin. It has to stay reachable by a full press.
+  combPressThreshold = int((2 * COMB_WINDOW) * (centerBias / 100.0) + COMB_WINDOW * (combMarginPerc / 100.0));
+  if (combPressThreshold > 2 * COMB_WINDOW - 1)
+  {
+    combPressThreshold = 2 * COMB_WINDOW - 1;
+  }
+  byteCounter = 0;
+  bitCounter = 0;
+  updateCombTaps();
+}
+
+/* Clears one input's samples, as if it had always been open. */
+inline void inputFilterClass::reset(filterState * f)
+{
+  for (int j=0; j<BUFFER_LENGTH; j++)
+  {
+    f->measurementBuffer[j] = 0;
+  }
+  f->oldestMeasurement = 0;
+  f->bufferSum = 0;
+  f->combSum = 0;
+  f->closedRun = 0;
+  f->confirmed = 0;
+  f->sincePress = 0;
+  f->sinceContact = 255;
+}
+
+/* Step 1: stores a new sample (closed = contact made) over the oldest one,
+ keeping the oldest for sum(). */
+inline void inputFilterClass::store(filterState * f, uint8_t closed)
+{
+  uint8_t currentByte = f->measurementBuffer[byteCounter];
+  f->oldestMeasurement = (currentByte >> bitCounter) & 0x01;
+
+  if (closed)
+  {
+    currentByte |= (1<<bitCounter);
+  }
+  else
+  {
+    currentByte &= ~(1<<bitCounter);
+  }
+  f->measurementBuffer[byteCounter] = currentByte;
+
+#if FAST_ATTACK
+  if (!closed)
+  {
+    f->closedRun = 0;
+  }
+  else if (f->closedRun < 255)
+  {
+    f->closedRun++;
+  }
+#endif
+}
+
+/* Step 2: the bufferSum is a running tally of the entire measurementBuffer,
+ add the new measurement and subtract the old one. */
+inline void inputFilterClass::sum(filterState * f)
+{
+  uint8_t currentMeasurement = (f->measurementBuffer[byteCounter] >> bitCounter) & 0x01;
+  f->bufferSum += currentMeasurement;
+  f->bufferSum -= f->oldestMeasurement;
+
+#if FAST_ATTACK
+  if (f->bufferSum > pressThreshold)
+  {
+    f->confirmed = 1;
+  }
+  if (f->sincePress < 255)
+  {
+    f->sincePress++;
+  }
+  if (currentMeasurement && (f->bufferSum == 1))
+  {
+    f->sinceContact = 0;  // the only closed sample in the last mains cycle
+  }
+  if (f->sinceContact < 255)
+  {
+    f->sinceContact++;
+  }
+#endif
+
+#if FILTER_MODE == FILTER_COMB
+  // the comb sum adds each new sample to the one half a mains cycle before it,
+  // a 50% square wave of hum adds up to 1 per pair, a contact adds 2 once it's
+  // half a mains cycle old (1 before that, no more than hum)
+  f->combSum += currentMeasurement;
+  f->combSum += (f->measurementBuffer[combTapByte[0]] >> combTapBit[0]) & 0x01;
+  f->combSum -= (f->measurementBuffer[combTapByte[1]] >> combTapBit[1]) & 0x01;
+  f->combSum -= (f->measurementBuffer[combTapByte[2]] >> combTapBit[2]) & 0x01;
+#endif
+}
+
+/* Step 3: moves on to the next sample, once every input has had store()
+ and sum(). */
+inline void inputFilterClass::advance()
+{
+  bitCounter++;
+  if (bitCounter == 8)
+  {
+    bitCounter = 0;
+    byteCounter++;
+    if (byteCounter == BUFFER_LENGTH)
+    {
+      byteCounter = 0;
+    }
+  }
+#if FILTER_MODE == FILTER_COMB
+  updateCombTaps();
+#endif
+}
+
+/* Call when an input becomes pressed, however it was detected. A fast
+ attack press comes in before the window has caught up, so it isn't
+ confirmed until the window sees it too. */
+inline void inputFilterClass::markPressed(filterState * f)
+{
+#if FAST_ATTACK
+  f->confirmed = (f->bufferSum > pressThreshold);
+  f->sincePress = 0;
+#endif
+}
+
+#if FAST_ATTACK
+/* Returns true if a released input can be pressed before the window has
+ caught up: a contact made after a quiet mains cycle has just settled 
+ into FAST_ATTACK_CONFIRM closed samples in a row, within 
+ FAST_ATTACK_SETTLE samples, so a little bounce is fine. Hum closes the 
+ input for part of every cycle and never starts a contact, only its
+ first cycle can get through. Checked on every sample, the run only
+ passes through FAST_ATTACK_CONFIRM once. */
+inline bool inputFilterClass::fastAttackDetected(const filterState * f)
+{
+  return (f->closedRun == FAST_ATTACK_CONFIRM) && (f->sinceContact <= FAST_ATTACK_SETTLE);
+}
+#endif
+
+/* Works out where the delayed samples used by the comb filter sit in the
+ measurement buffers, relative to the current byteCounter/bitCounter.
+ Done once per sample, rather than once per input. */
+inline void inputFilterClass::updateCombTaps()
+{
+  const uint8_t delays[3] = {COMB_DELAY, COMB_WINDOW, COMB_WINDOW + COMB_DELAY};
+  uint8_t position = byteCounter * 8 + bitCounter;
+
+  for (int t=0; t<3; t++)
+  {
+    uint8_t tap = (position + BUFFER_LENGTH * 8 - delays[t]) % (BUFFER_LENGTH * 8);
+    combTapByte[t] = tap >> 3;
+    combTapBit[t] = tap & 0x07;
+  }
+}
+
+/* Returns true if a released input is now pressed. */
+inline bool inputFilterClass::pressDetected(const filterState * f)
+{
+#if FILTER_MODE == FILTER_COMB
+  return (f->bufferSum > pressThreshold) || (f->combSum > combPressThreshold);
+#else
+  return f->bufferSum > pressThreshold;
+#endif
+}
+
+/* Returns true if a pressed input is now released. Comb presses come in
+ before the window has caught up, so the window's release is held off
+ until they agree. A fast attack press the window hasn't confirmed yet (a
+ short tap, or the start of hum) is held for a whole mains cycle, a few
+ closed samples are far below releaseThreshold and would chatter. After
+ that the window decides. */
+inline bool inputFilterClass::releaseDetected(const filterState * f)
+{
+#if FAST_ATTACK
+  if (!f->confirmed && (f->sincePress < BUFFER_LENGTH * 8))
+  {
+    return false;
+  }
+#endif
+  if (f->bufferSum >= releaseThreshold)
+  {
+    return false;
+  }
+#if FILTER_MODE == FILTER_COMB
+  if (f->combSum > combPressThreshold)
+  {
+    return false;
+  }
+#endif
+  return true;
+}
+
+#endif	// inputFilter_H
@@ -26,9 +26,19 @@
 
 #define BUFFER_LENGTH    3     // 3 bytes gives us 24 samples
 #define NUM_INPUTS       18    // 6 on the front + 12 on the back
-//#define TARGET_LOOP_TIME 694   // (1/60 seconds) / 24 samples = 694 microseconds per sample 
-//#define TARGET_LOOP_TIME 758  // (1/55 seconds) / 24 samples = 758 microseconds per sample 
-#define TARGET_LOOP_TIME 744  // (1/56 seconds) / 24 samples = 744 microseconds per sample 
+// (1/MAINS_FREQUENCY seconds) / 24 samples, MAINS_FREQUENCY is set in settings.h
+// 60 Hz = 694, 56 Hz = 744, 50 Hz = 833 microseconds per sample
+#define TARGET_LOOP_TIME int(1000000L / (MAINS_FREQUENCY * (BUFFER_LENGTH * 8L)))
+#define LED_TICK_TIME    1000  // charlieplexed LED refresh, one LED per tick, in microseconds
+#define LED_UPDATE_TIME  10000  // how often the LED task rebuilds the LED states, in microseconds
+#define LINK_UPDATE_TIME 10000  // how often the link task checks output and RN-42, in microseconds
+#define CONSOLE_TIME     20000  // how often the console task runs, in microseconds
+#define WATCHDOG_TIMEOUT WDTO_8S  // reset if the loop stalls this long, connect() can block for several seconds
+
+// The 32U4 core jumps to the bootloader (for uploads) by writing this key
+// and starting a short watchdog timeout, which mustn't be reset.
+#define BOOTLOADER_KEY      0x7777
+#define BOOTLOADER_KEY_PTR  ((volatile uint16_t *) 0x0800)
 
 // id numbers for mouse movement inputs (used in settings.h)
 #define MOUSE_MOVE_UP       -1 
@@ -36,19 +46,24 @@
 #define MOUSE_MOVE_LEFT     -3
 #define MOUSE_MOVE_RIGHT    -4
 
+// id number for the layer switch input (used in settings.h)
+#define LAYER_NEXT          -5
+
+#include "gestures.h"
 #include "settings.h"
 #include <SoftwareSerial.h>
+#include <avr/wdt.h>
+#include <avr/sleep.h>
 #include "makeyMate.h"
+#include "eventLog.h"
+#include "inputFilter.h"
 
 /////////////////////////
 // STRUCT ///////////////
 /////////////////////////
 typedef struct {
   byte pinNumber;
-  int keyCode;
-  byte measurementBuffer[BUFFER_LENGTH]; 
-  boolean oldestMeasurement;
-  byte bufferSum;
+  filterState filter;  // samples and sums, see inputFilter.h
   boolean pressed;
   boolean prevPressed;
   boolean isMouseMotion;
@@ -62,16 +77,25 @@ MakeyMakeyInput inputs[NUM_INPUTS];
 // VARIABLES //////////////////////
 ///////////////////////////////////
 int bufferIndex = 0;
-byte byteCounter = 0;
-byte bitCounter = 0;
-int mouseMovementCounter = 0; // for sending mouse movement events at a slower interval
-
-int pressThreshold;
-int releaseThreshold;
+inputFilterClass inputFilter;  // sample buffers and thresholds
+
+#if FAST_ATTACK
+// FAST_ATTACK inputs, the ones on the 32U4's external interrupt pins. 
+// (The pin change interrupts are already taken by SoftwareSerial.)
+#define FAST_ATTACK_INPUTS 5
+const byte fastAttackInput[FAST_ATTACK_INPUTS] = {4, 8, 9, 10, 11};  // space pad, pins D3, D2, D1, D0
+const byte fastAttackInterrupt[FAST_ATTACK_INPUTS] = {4, 0, 1, 3, 2};  // interrupt numbers for those pins
+volatile byte fastAttackEdges = 0;  // bit n set when fastAttackInput[n] has seen a contact edge
+volatile unsigned long fastAttackTime[FAST_ATTACK_INPUTS];  // micros() of that edge
+#endif
 boolean inputChanged;
+boolean idle = false;  // no contact for IDLE_TIMEOUT, sampling slowed down
+unsigned long lastContact;  // millis() of the last sample with contact on any input
 
 int mouseHoldCount[NUM_INPUTS]; // used to store mouse movement hold data
 
+byte activeLayer = 0;  // which keyCodes layer in settings.h is in use
+
 // Pin Numbers
 // input pin numbers for kickstarter production board
 const int pinNumbers[NUM_INPUTS] = 
@@ -81,33 +105,125 @@ const int pinNumbers[NUM_INPUTS] =
   23, 22, 21, 20, 19, 18   // right side of female header, MOUSE - up, down, left, right, left click, right click
 };
 
-// input status LED pin numbers
-const int inputLED_a = 9;
-const int inputLED_b = 10;
-const int inputLED_c = 11;
-byte ledCycleCounter = 0;
+// input status LEDs, charlieplexed on pins 9, 10 and 11 (PB5, PB6, PB7 on the 32U4)
+#define LED_A_BIT     (1<<5)  // pin 9
+#define LED_B_BIT     (1<<6)  // pin 10
+#define LED_C_BIT     (1<<7)  // pin 11
+#define LED_PIN_MASK  (LED_A_BIT | LED_B_BIT | LED_C_BIT)
+#define LED_OFF       6     // index of the all-off state in the tables below
+
+// DDRB and PORTB bits for each charlieplex state:
+// up, down, left, right, space, click, off
+const byte ledDdr[7] = 
+{
+  LED_B_BIT | LED_C_BIT, LED_A_BIT | LED_B_BIT, LED_A_BIT | LED_B_BIT,
+  LED_B_BIT | LED_C_BIT, LED_A_BIT | LED_C_BIT, LED_A_BIT | LED_C_BIT, 0
+};
+const byte ledPort[7] = 
+{
+  LED_A_BIT | LED_B_BIT, LED_A_BIT, LED_B_BIT, 
+  LED_C_BIT, LED_C_BIT, LED_A_BIT, 0
+};
+volatile byte ledMask = 0;  // bit n lights LED n, refreshed from the timer tick
+
+// startup/reconnect LED dance, stepped from the LED timer tick
+#define DANCE_CIRCLE_TIME  50   // ms per frame, 4 laps of up->right->down->left
+#define DANCE_WIGGLE_TIME  100  // ms per frame, 4 wiggles of space->click
+#define DANCE_FRAMES       24   // 16 circle frames + 8 wiggle frames
+const byte danceCircle[4] = {0, 3, 1, 2};  // up, right, down, left
+const byte danceWiggle[2] = {4, 5};  // space, click
+volatile byte danceFrame = DANCE_FRAMES;  // DANCE_FRAMES when not dancing
 
-// timing
-int loopTime = 0;
-int prevTime = 0;
-int loopCounter = 0;
+// USB serial console
+boolean eventStreaming = false;  // send the event log to the host, toggled with 'E'
+#define EVENTS_PER_RUN  8  // most event records sent per console task run
 
 ///////////////////////////
 // FUNCTIONS //////////////
 ///////////////////////////
 void initializeArduino();
 void initializeInputs();
+void classifyInput(int i);
+int inputKeyCode(int i);
+boolean keyPriority(int i);
+void setLayer(byte layer);
 void updateMeasurementBuffers();
 void updateBufferSums();
 void updateBufferIndex();
 void updateInputStates();
+void pressInput(int i);
+void initializeFastAttack();
+void checkFastAttack();
+void updateIdle();
+void setIdle(boolean on);
+void pollInputs();
 void sendMouseButtonEvents();
 void sendMouseMovementEvents();
-void addDelay();
-void cycleLEDs();
-void danceLeds();
+void sampleInputs();
+void sendReports();
+void updateLEDs();
+void updateLink();
+void runTask(byte t, unsigned long now);
+void petWatchdog();
+void serviceConsole();
+void printLinkStats();
+void printTaskStats();
+void printMemoryStats();
+unsigned int stackUnused(uint8_t * heapTop);
+void initializeLEDTimer();
+void setLedState(byte state);
+void updateInputLEDs();
+void startDance();
+void runGestureAction(byte action);
 void updateOutLEDs();
 
+///////////////////////////
+// TASKS //////////////////
+///////////////////////////
+/* loop() is a small cooperative scheduler. Each pass:
+ 1) the sample task runs if it's due, sampling always comes first
+ 2) any task it readied (reports) runs straight after
+ 3) then at most one periodic task runs, the most overdue. Housekeeping
+    tasks only start if their worst run so far fits before the next 
+    sample, unless they're past their own deadline.
+ While idle, a pass with nothing to run sleeps until the next interrupt.
+ Samples only stay on the TARGET_LOOP_TIME grid while no run is longer
+ than a sample period, and some are: SoftwareSerial sends a byte to the
+ RN-42 in about 1 ms with interrupts off, so a 9 byte keyboard report 
+ holds the loop for about 12 samples. Those samples are skipped, not 
+ made up later, and counted (see runTask()). */
+#define TASK_SAMPLE   0
+#define TASK_REPORTS  1
+#define TASK_MOUSE    2
+#define TASK_LEDS     3
+#define TASK_LINK     4
+#define TASK_CONSOLE  5
+#define NUM_TASKS     6
+
+typedef struct {
+  void (*run)();
+  unsigned long period;  // microseconds between runs, 0 = only runs when readied
+  unsigned long deadline;  // microseconds late a run can start before it's a miss
+  boolean housekeeping;  // can wait for a gap between samples
+  boolean ready;  // run on this pass, for period 0 tasks
+  unsigned long due;  // micros() of the next run
+  unsigned int worst;  // longest run so far, in microseconds
+  unsigned int misses;  // runs that started past their deadline
+  unsigned int skipped;  // runs dropped because the task fell a whole period behind
+} 
+Task;
+
+Task tasks[NUM_TASKS] = 
+{
+  // run                   period                                                  deadline              housekeeping
+  {sampleInputs,            TARGET_LOOP_TIME,                                       TARGET_LOOP_TIME / 4, false},
+  {sendReports,             0,                                                      0,                    false},
+  {sendMouseMovementEvents, MOUSE_MOTION_UPDATE_INTERVAL * (long) TARGET_LOOP_TIME, TARGET_LOOP_TIME * 4, false},
+  {updateLEDs,              LED_UPDATE_TIME,                                        LED_UPDATE_TIME,      true},
+  {updateLink,              LINK_UPDATE_TIME,                                       LINK_UPDATE_TIME,     true},
+  {serviceConsole,          CONSOLE_TIME,                                           CONSOLE_TIME,         true}
+};
+
 ///////////////////////////
 // Bluetooth Mate Stuff ///
 ///////////////////////////
@@ -117,12 +233,8 @@ makeyMateClass makeyMate;  // create a makeyMateClass object named makeyMate
 // with a \r character.
 char makeyMateName[] = "MaKeyMate\r";
 
-// button logger stuff:
-const byte SEQUENCE_LENGTH = 6;
-int buttonSequence[SEQUENCE_LENGTH] = {0, 0, 0, 0, 0, 0};
-int sequenceIndex = 0;
-int sequenceInterval = 1000;  // in ms
-int resetSequence[SEQUENCE_LENGTH] = {0, 1, 2, 3, 4, 5};  // u->d->l->r->space->click
+// gesture recognizer, gestures are listed in settings.h
+gestureClass gestures;
 
 //////////////////////
 // SETUP /////////////
@@ -132,10 +244,25 @@ void setup()
 {
   initializeArduino();
   initializeInputs();
-  danceLeds();
+#if FAST_ATTACK
+  initializeFastAttack();
+#endif
+  gestures.begin(gestureList, sizeof(gestureList) / sizeof(gesture));
+  initializeLEDTimer();
+  startDance();  // runs from the LED timer while the bluetooth mate is set up
   
   makeyMate.begin(makeyMateName);  // Initialize the bluetooth mate
   makeyMate.connect();  // Attempt to connect to a stored remote address
+
+  unsigned long now = micros();
+  for (byte t=0; t<NUM_TASKS; t++)
+  {
+    tasks[t].due = now;
+  }
+  lastContact = millis();
+  set_sleep_mode(SLEEP_MODE_IDLE);  // the only mode that keeps USB and the timers running
+
+  wdt_enable(WATCHDOG_TIMEOUT);  // from here on, a stalled loop resets the board
 }
 
 ////////////////////
@@ -143,15 +270,104 @@ void setup()
 ////////////////////
 void loop() 
 {
-  updateMeasurementBuffers();  // Step 1: read inputs, update measurementBuffer
-  updateBufferSums();  // Step 2: update bufferSum, remove old measruement, add new
-  updateBufferIndex();  // Step 3: update bitCounter and byteCounter
-  updateInputStates();  // Step 4: check/update pressed/released states, send button presses/releases
-  sendMouseButtonEvents();  // Step 5: Send mouse button click/releases
-  sendMouseMovementEvents(); // Step 6: Send mouse movement
-  cycleLEDs();  // Step 7: Update U/D/L/R/Space/Click LEDs
-  updateOutLEDs();  // Step 8: Update output LEDs (K/M)
-  addDelay();
+  unsigned long now = micros();
+
+#if FAST_ATTACK
+  if (idle && fastAttackEdges)
+  {
+    setIdle(false);  // contact edge, back to full rate right away
+  }
+#endif
+
+  // 1) sampling always wins
+  if ((long)(now - tasks[TASK_SAMPLE].due) >= 0)
+  {
+    runTask(TASK_SAMPLE, now);
+  }
+
+  // 2) tasks readied by the sample task
+  for (byte t=0; t<NUM_TASKS; t++)
+  {
+    if (tasks[t].ready)
+    {
+      tasks[t].ready = false;
+      runTask(t, micros());
+    }
+  }
+
+  // 3) the most overdue periodic task that fits
+  now = micros();
+  long timeLeft = tasks[TASK_SAMPLE].due - now;
+  int next = -1;
+  for (byte t=1; t<NUM_TASKS; t++)
+  {
+    long late = now - tasks[t].due;
+    if ((tasks[t].period == 0) || (late < 0))
+    {
+      continue;  // not periodic, or not due
+    }
+    if (tasks[t].housekeeping && (tasks[t].worst > timeLeft) && (late <= (long) tasks[t].deadline))
+    {
+      continue;  // would hold up the next sample, and can still wait
+    }
+    if ((next < 0) || ((long)(tasks[t].due - tasks[next].due) < 0))
+    {
+      next = t;
+    }
+  }
+  if (next >= 0)
+  {
+    runTask(next, now);
+  }
+
+  petWatchdog();  // Tell the watchdog the loop is still running
+
+  if (idle && (next < 0))
+  {
+    sleep_mode();  // until the next interrupt, the 1 ms millis() tick at the latest
+  }
+}
+
+///////////////////////////
+// RUN TASK ///////////////
+///////////////////////////
+/* Runs task t, keeping its schedule and timing statistics. A task that's
+ fallen a whole period behind skips the runs it missed, they're counted
+ in skipped (and in the overrun event, for the sample task). */
+void runTask(byte t, unsigned long now)
+{
+  Task * task = &tasks[t];
+
+  if (task->period)
+  {
+    unsigned long late = now - task->due;
+    unsigned long skipped = late / task->period;  // runs that came due while it was behind
+    if (late > task->deadline)
+    {
+      task->misses++;
+      if (t == TASK_SAMPLE)
+      {
+        eventLog.record(EVENT_OVERRUN, min(skipped, 255UL), min(late, 65535UL));
+      }
+    }
+    if (skipped)
+    {
+      task->skipped = min((unsigned long) task->skipped + skipped, 65535UL);
+      task->due = now + task->period;
+    }
+    else
+    {
+      task->due += task->period;
+    }
+  }
+
+  task->run();
+
+  unsigned long took = micros() - now;
+  if (took > task->worst)
+  {
+    task->worst = min(took, 65535UL);
+  }
 }
 
 
@@ -169,12 +385,22 @@ void initializeArduino()
     digitalWrite(pinNumbers[i], LOW);
   }
 
-  pinMode(inputLED_a, INPUT);
-  pinMode(inputLED_b, INPUT);
-  pinMode(inputLED_c, INPUT);
-  digitalWrite(inputLED_a, LOW);
-  digitalWrite(inputLED_b, LOW);
-  digitalWrite(inputLED_c, LOW);
+  setLedState(LED_OFF);
+}
+
+///////////////////////////
+// INITIALIZE LED TIMER ///
+////// Setup //////////////
+///////////////////////////
+void initializeLEDTimer()
+{
+  /* Timer3 in CTC mode with a /64 prescaler. The compare match interrupt
+   refreshes one charlieplexed LED every LED_TICK_TIME microseconds, so
+   the main loop never has to touch the LED pins. */
+  TCCR3A = 0;
+  TCCR3B = (1<<WGM32) | (1<<CS31) | (1<<CS30);
+  OCR3A = (F_CPU / 64 / 1000) * LED_TICK_TIME / 1000 - 1;
+  TIMSK3 = (1<<OCIE3A);
 }
 
 ///////////////////////////
@@ -183,125 +409,256 @@ void initializeArduino()
 ///////////////////////////
 void initializeInputs() {
 
-  float thresholdPerc = SWITCH_THRESHOLD_OFFSET_PERC;
-  float thresholdCenterBias = SWITCH_THRESHOLD_CENTER_BIAS/50.0;
-  float pressThresholdAmount = (BUFFER_LENGTH * 8) * (thresholdPerc / 100.0);
-  float thresholdCenter = ( (BUFFER_LENGTH * 8) / 2.0 ) * (thresholdCenterBias);
-  pressThreshold = int(thresholdCenter + pressThresholdAmount);
-  releaseThreshold = int(thresholdCenter - pressThresholdAmount);
+  inputFilter.begin(SWITCH_THRESHOLD_OFFSET_PERC, SWITCH_THRESHOLD_CENTER_BIAS, COMB_PRESS_MARGIN_PERC);
 
   for (int i=0; i<NUM_INPUTS; i++)
   {
     inputs[i].pinNumber = pinNumbers[i];
-    inputs[i].keyCode = keyCodes[i];
 
-    for (int j=0; j<BUFFER_LENGTH; j++)
-    {
-      inputs[i].measurementBuffer[j] = 0;
-    }
-    inputs[i].oldestMeasurement = 0;
-    inputs[i].bufferSum = 0;
+    inputFilter.reset(&inputs[i].filter);
 
     inputs[i].pressed = false;
     inputs[i].prevPressed = false;
 
-    inputs[i].isMouseMotion = false;
-    inputs[i].isMouseButton = false;
-    inputs[i].isKey = false;
+    classifyInput(i);
+  }
+}
+
+///////////////////////////
+// CLASSIFY INPUT /////////
+///////////////////////////
+/* Sets the isMouseMotion/isMouseButton/isKey flags of input i from its
+ key code in the active layer. Layer switch inputs set none of them. */
+void classifyInput(int i)
+{
+  int keyCode = inputKeyCode(i);
+
+  inputs[i].isMouseMotion = false;
+  inputs[i].isMouseButton = false;
+  inputs[i].isKey = false;
+
+  if (keyCode == LAYER_NEXT)
+  {
+    return;  // switches layers, nothing is sent to the host
+  }
+
+  if (keyCode < 0)
+  {
+    inputs[i].isMouseMotion = true;
+  } 
+  else if ((keyCode == MOUSE_LEFT) || (keyCode == MOUSE_RIGHT))
+  {
+    inputs[i].isMouseButton = true;
+  } 
+  else
+  {
+    inputs[i].isKey = true;
+  }
+}
 
-    if (inputs[i].keyCode < 0)
+///////////////////////////
+// INPUT KEY CODE /////////
+///////////////////////////
+/* Returns the key code of input i in the active layer. The keyCodes
+ table lives in flash, see settings.h */
+int inputKeyCode(int i)
+{
+  return pgm_read_word(&keyCodes[activeLayer][i]);
+}
+
+/* Returns true if input i's key always stays in the keyboard report, see
+ ROLLOVER_PRIORITY in settings.h */
+boolean keyPriority(int i)
+{
+  return ((unsigned long) ROLLOVER_PRIORITY >> i) & 1;
+}
+
+///////////////////////////
+// SET LAYER //////////////
+///////////////////////////
+/* Switches to another keyCodes layer. Everything held under the old layer
+ is released first so nothing gets stuck. Inputs that are still held stay
+ silent until they're released, then they take on their new key code. */
+void setLayer(byte layer)
+{
+  for (int i=0; i<NUM_INPUTS; i++)
+  {
+    if (inputs[i].pressed)
     {
-      inputs[i].isMouseMotion = true;
-    } 
-    else if ((inputs[i].keyCode == MOUSE_LEFT) || (inputs[i].keyCode == MOUSE_RIGHT))
+      if (inputs[i].isKey)
+      {
+        makeyMate.keyRelease(inputKeyCode(i));
+      }
+      if (inputs[i].isMouseButton)
+      {
+        makeyMate.moveMouse(0, 0, 0);
+      }
+      mouseHoldCount[i] = 0;
+      inputs[i].isMouseMotion = false;
+      inputs[i].isMouseButton = false;
+      inputs[i].isKey = false;
+    }
+  }
+
+  activeLayer = layer % NUM_LAYERS;
+
+  for (int i=0; i<NUM_INPUTS; i++)
+  {
+    if (!inputs[i].pressed)
     {
-      inputs[i].isMouseButton = true;
-    } 
-    else
+      classifyInput(i);
+    }
+  }
+}
+
+///////////////////////////
+// SAMPLE INPUTS //////////
+///// Sample task /////////
+///////////////////////////
+void sampleInputs()
+{
+  if (idle)
+  {
+    pollInputs();  // just look for contact, the filter waits for full rate
+    return;
+  }
+  updateMeasurementBuffers();  // Step 1: read inputs, update measurementBuffer
+  updateBufferSums();  // Step 2: update bufferSum, remove old measruement, add new
+  updateBufferIndex();  // Step 3: update bitCounter and byteCounter
+  updateInputStates();  // Step 4: check/update pressed/released states, queue key presses/releases
+  updateIdle();  // Step 5: slow down if nothing's been touched for a while
+  if (inputChanged)
+  {
+    tasks[TASK_REPORTS].ready = true;
+  }
+}
+
+///////////////////////////
+// UPDATE IDLE ////////////
+//// Sample task: Step 5 //
+///////////////////////////
+/* Goes idle once no input has seen contact for IDLE_TIMEOUT seconds. 
+ A single closed sample anywhere in a window counts as contact, so the
+ buffers are all open when sampling slows down. */
+void updateIdle()
+{
+#if IDLE_TIMEOUT
+  for (int i=0; i<NUM_INPUTS; i++)
+  {
+    if (inputs[i].pressed || inputs[i].filter.bufferSum)
     {
-      inputs[i].isKey = true;
+      lastContact = millis();
+      return;
     }
+  }
+  if (millis() - lastContact >= IDLE_TIMEOUT * 1000UL)
+  {
+    setIdle(true);
+  }
+#endif
+}
 
+///////////////////////////
+// SET IDLE ///////////////
+///////////////////////////
+/* Switches the sample task between full rate and the idle rate, 
+ IDLE_SAMPLE_DIVIDER times slower. Idle samples can start up to a
+ sleep (1 ms) late, so they aren't counted as misses. Waking samples 
+ right away. */
+void setIdle(boolean on)
+{
+  idle = on;
+  if (idle)
+  {
+    tasks[TASK_SAMPLE].period = (long) TARGET_LOOP_TIME * IDLE_SAMPLE_DIVIDER;
+    tasks[TASK_SAMPLE].deadline = tasks[TASK_SAMPLE].period;
+  }
+  else
+  {
+    tasks[TASK_SAMPLE].period = TARGET_LOOP_TIME;
+    tasks[TASK_SAMPLE].deadline = TARGET_LOOP_TIME / 4;
+    tasks[TASK_SAMPLE].due = micros();
+    lastContact = millis();
   }
 }
 
+///////////////////////////
+// POLL INPUTS ////////////
+///// Sample task, idle ///
+///////////////////////////
+/* Checks every input once, and wakes on the first one that's closed.
+ Nothing is stored, so the measurement buffers pick up right where they
+ left off and a press that started while idle is filtered as usual. */
+void pollInputs()
+{
+  for (int i=0; i<NUM_INPUTS; i++)
+  {
+    if (!digitalRead(inputs[i].pinNumber))
+    {
+      setIdle(false);
+      return;
+    }
+  }
+}
+
+///////////////////////////
+// SEND REPORTS ///////////
+///// Reports task ////////
+///////////////////////////
+void sendReports()
+{
+  makeyMate.sendReport();  // one keyboard report for everything that changed
+  sendMouseButtonEvents();  // mouse button click/releases
+}
+
+///////////////////////////
+// UPDATE LINK ////////////
+///// Link task ///////////
+///////////////////////////
+void updateLink()
+{
+  makeyMate.updateOutput();  // Send reports over USB when plugged in, bluetooth otherwise
+  makeyMate.supervise();  // Recover the bluetooth mate if it stopped responding
+  makeyMate.sendReport();  // Anything held back during recovery
+}
+
 ////////////////////////////////
 // UPDATE MEASUREMENT BUFFERS //
-////// Loop: Step 1 ////////////
+////// Sample task: Step 1 /////
 ////////////////////////////////
 void updateMeasurementBuffers() 
 {
   for (int i=0; i<NUM_INPUTS; i++)
   {
-    // store the oldest measurement, which is the one at the current index,
-    // before we update it to the new one 
-    // we use oldest measurement in updateBufferSums
-    byte currentByte = inputs[i].measurementBuffer[byteCounter];
-    inputs[i].oldestMeasurement = (currentByte >> bitCounter) & 0x01; 
-
-    // make the new measurement
-    boolean newMeasurement = digitalRead(inputs[i].pinNumber);
-
     // invert so that true means the switch is closed
-    newMeasurement = !newMeasurement; 
-
-    // store it    
-    if (newMeasurement)
-    {
-      currentByte |= (1<<bitCounter);
-    } 
-    else
-    {
-      currentByte &= ~(1<<bitCounter);
-    }
-    inputs[i].measurementBuffer[byteCounter] = currentByte;
+    inputFilter.store(&inputs[i].filter, !digitalRead(inputs[i].pinNumber));
   }
 }
 
 ///////////////////////////
 // UPDATE BUFFER SUMS /////
-//// Loop: Step 2 /////////
+//// Sample task: Step 2 //
 ///////////////////////////
 void updateBufferSums() 
 {
-  // the bufferSum is a running tally of the entire measurementBuffer
-  // add the new measurement and subtract the old one
   for (int i=0; i<NUM_INPUTS; i++)
   {
-    byte currentByte = inputs[i].measurementBuffer[byteCounter];
-    boolean currentMeasurement = (currentByte >> bitCounter) & 0x01; 
-    if (currentMeasurement)
-    {
-      inputs[i].bufferSum++;
-    }
-    if (inputs[i].oldestMeasurement)
-    {
-      inputs[i].bufferSum--;
-    }
+    inputFilter.sum(&inputs[i].filter);
   }  
 }
 
 ///////////////////////////
 // UPDATE BUFFER INDEX ////
-///// Loop: Step 3 ////////
+//// Sample task: Step 3 //
 ///////////////////////////
 void updateBufferIndex() 
 {
-  bitCounter++;
-  if (bitCounter == 8)
-  {
-    bitCounter = 0;
-    byteCounter++;
-    if (byteCounter == BUFFER_LENGTH)
-    {
-      byteCounter = 0;
-    }
-  }
+  inputFilter.advance();
 }
 
 ///////////////////////////
 // UPDATE INPUT STATES ////
-///// Loop: Step 4 ////////
+//// Sample task: Step 4 //
 ///////////////////////////
 void updateInputStates()
 {
@@ -309,55 +666,158 @@ void updateInputStates()
   int count = 0;
   
   inputChanged = false;
+#if FAST_ATTACK
+  checkFastAttack();
+#endif
   for (int i=0; i<NUM_INPUTS; i++) 
   {
     inputs[i].prevPressed = inputs[i].pressed; // store previous pressed state (only used for mouse buttons)
     if (inputs[i].pressed)  // if it was _previously_ pressed
     {
 // Pressed -> Released
-      if (inputs[i].bufferSum < releaseThreshold)
+      if (inputFilter.releaseDetected(&inputs[i].filter))
       {  
         inputChanged = true;
         inputs[i].pressed = false;
+        eventLog.record(EVENT_RELEASE, i, 0);
         if (inputs[i].isKey) 
         {
-          makeyMate.keyRelease(inputs[i].keyCode);
+          makeyMate.keyRelease(inputKeyCode(i));
         }
         if (inputs[i].isMouseMotion) 
         {  
           mouseHoldCount[i] = 0;  // input becomes released, reset mouse hold
         }
+        gestures.release(i);
+        classifyInput(i);  // picks up a layer change made while it was held
       }
 // Pressed -> Pressed
       else if (inputs[i].isMouseMotion) 
       {  
         mouseHoldCount[i]++; // input remains pressed, increment mouse hold
       }
-      else
-      {
-        makeyMate.keyPress(inputs[i].keyCode);
-      }
     }
 // Released -> Pressed
     else if (!inputs[i].pressed)
     {
-      if (inputs[i].bufferSum > pressThreshold) // input becomes pressed
+      if (inputFilter.pressDetected(&inputs[i].filter)) // input becomes pressed
       {
-        inputChanged = true;
-        inputs[i].pressed = true; 
-        checkSequence(i, resetSequence);  // Run the new key through reset sequence check
-        if (inputs[i].isKey)
-        {
-          makeyMate.keyPress(inputs[i].keyCode);
-        }
+        pressInput(i);
       }
     }
   }
 }
 
+/* Released -> Pressed for input i: sends the key press and runs the
+ press through the layer switch and gestures. */
+void pressInput(int i)
+{
+  inputChanged = true;
+  inputs[i].pressed = true; 
+  inputFilter.markPressed(&inputs[i].filter);
+  eventLog.record(EVENT_PRESS, i, 0);
+  if (inputKeyCode(i) == LAYER_NEXT)
+  {
+    setLayer(activeLayer + 1);
+  }
+  runGestureAction(gestures.press(i, millis()));  // Run the new press through the gestures
+  if (inputs[i].isKey)
+  {
+    makeyMate.keyPress(inputKeyCode(i), keyPriority(i));
+  }
+}
+
+#if FAST_ATTACK
+///////////////////////////
+// FAST ATTACK ////////////
+///////////////////////////
+/* A contact pulls the input low, so the falling edge interrupt marks the
+ moment of contact. Only the first edge is kept until checkFastAttack()
+ has dealt with it. */
+#define FAST_ATTACK_EDGE(n) \
+void fastAttackEdge##n() \
+{ \
+  if (!(fastAttackEdges & (1<<n))) \
+  { \
+    fastAttackTime[n] = micros(); \
+    fastAttackEdges |= (1<<n); \
+  } \
+}
+FAST_ATTACK_EDGE(0)
+FAST_ATTACK_EDGE(1)
+FAST_ATTACK_EDGE(2)
+FAST_ATTACK_EDGE(3)
+FAST_ATTACK_EDGE(4)
+
+void (* const fastAttackEdge[FAST_ATTACK_INPUTS])() = 
+{
+  fastAttackEdge0, fastAttackEdge1, fastAttackEdge2, fastAttackEdge3, fastAttackEdge4
+};
+
+void initializeFastAttack()
+{
+  for (int n=0; n<FAST_ATTACK_INPUTS; n++)
+  {
+    attachInterrupt(fastAttackInterrupt[n], fastAttackEdge[n], FALLING);
+  }
+}
+
+/* Presses a fast attack input as soon as FAST_ATTACK_CONFIRM closed
+ samples in a row follow its contact edge, instead of waiting for the
+ window, if there was no other contact in the last mains cycle (see
+ fastAttackDetected()). The time from edge to press goes in the event 
+ log. An edge that isn't followed by a closed sample is dropped as 
+ noise, one that comes with hum is left to the filter. */
+void checkFastAttack()
+{
+  byte edges = fastAttackEdges;
+
+  for (int n=0; n<FAST_ATTACK_INPUTS; n++)
+  {
+    if (!(edges & (1<<n)))
+    {
+      continue;
+    }
+
+    int i = fastAttackInput[n];
+    unsigned long sinceEdge = micros() - fastAttackTime[n];
+    boolean done = true;
+
+    if (inputs[i].pressed)
+    {
+      // already pressed, nothing to do
+    }
+    else if (inputFilter.fastAttackDetected(&inputs[i].filter))
+    {
+      pressInput(i);
+      eventLog.record(EVENT_CONTACT, i, min(sinceEdge, 65535UL));
+    }
+    else if (inputs[i].filter.closedRun >= FAST_ATTACK_CONFIRM)
+    {
+      // hum in the window, the filter decides this one
+    }
+    else if ((inputs[i].filter.closedRun == 0) && (sinceEdge > 2 * TARGET_LOOP_TIME))
+    {
+      // noise, no closed sample followed the edge
+    }
+    else
+    {
+      done = false;  // still confirming
+    }
+
+    if (done)
+    {
+      noInterrupts();
+      fastAttackEdges &= ~(1<<n);
+      interrupts();
+    }
+  }
+}
+#endif
+
 //////////////////////////////
 // SEND MOUSE BUTTON EVENTS //
-///// Loop: Step 5 ///////////
+///// Reports task ///////////
 //////////////////////////////
 void sendMouseButtonEvents()
 {
@@ -366,24 +826,25 @@ void sendMouseButtonEvents()
     {
       if (inputs[i].isMouseButton)
       {
+        int keyCode = inputKeyCode(i);
         if (inputs[i].pressed)
         {
-          if (inputs[i].keyCode == MOUSE_LEFT)
+          if (keyCode == MOUSE_LEFT)
           {
             makeyMate.moveMouse(MOUSE_LEFT, 0, 0);
           } 
-          if (inputs[i].keyCode == MOUSE_RIGHT)
+          if (keyCode == MOUSE_RIGHT)
           {
             makeyMate.moveMouse(MOUSE_RIGHT, 0, 0);
           } 
         } 
         else if (inputs[i].prevPressed)
         {
-          if (inputs[i].keyCode == MOUSE_LEFT)
+          if (keyCode == MOUSE_LEFT)
           {
             makeyMate.moveMouse(0, 0, 0);
           } 
-          if (inputs[i].keyCode == MOUSE_RIGHT)
+          if (keyCode == MOUSE_RIGHT)
           {
             makeyMate.moveMouse(0, 0, 0);
           }           
@@ -395,7 +856,7 @@ void sendMouseButtonEvents()
 
 /////////////////////////////////
 // SEND MOUSE MOVEMENT EVENTS ///
-///// Loop: Step 6 //////////////
+///// Mouse task ////////////////
 /////////////////////////////////
 void sendMouseMovementEvents()
 {
@@ -406,170 +867,359 @@ void sendMouseMovementEvents()
   byte horizmotion = 0;
   byte vertmotion = 0;
 
-  mouseMovementCounter++;
-  mouseMovementCounter %= MOUSE_MOTION_UPDATE_INTERVAL;
-  if (mouseMovementCounter == 0)
+  for (int i=0; i<NUM_INPUTS; i++)
   {
-    for (int i=0; i<NUM_INPUTS; i++)
+    if (inputs[i].isMouseMotion)
     {
-
-      if (inputs[i].isMouseMotion)
+      if (inputs[i].pressed)
       {
-        if (inputs[i].pressed)
+        int keyCode = inputKeyCode(i);
+        if (keyCode == MOUSE_MOVE_UP)
         {
-          if (inputs[i].keyCode == MOUSE_MOVE_UP)
-          {
-            up=constrain(1+mouseHoldCount[i]/MOUSE_RAMP_SCALE, 1, MOUSE_MAX_PIXELS);
-          }  
-          if (inputs[i].keyCode == MOUSE_MOVE_DOWN)
-          {
-            down=constrain(1+mouseHoldCount[i]/MOUSE_RAMP_SCALE, 1, MOUSE_MAX_PIXELS);
-          }  
-          if (inputs[i].keyCode == MOUSE_MOVE_LEFT)
-          {
-            left=constrain(1+mouseHoldCount[i]/MOUSE_RAMP_SCALE, 1, MOUSE_MAX_PIXELS);
-          }  
-          if (inputs[i].keyCode == MOUSE_MOVE_RIGHT)
-          {
-            right=constrain(1+mouseHoldCount[i]/MOUSE_RAMP_SCALE, 1, MOUSE_MAX_PIXELS);
-          }  
-        }
+          up=constrain(1+mouseHoldCount[i]/MOUSE_RAMP_SCALE, 1, MOUSE_MAX_PIXELS);
+        }  
+        if (keyCode == MOUSE_MOVE_DOWN)
+        {
+          down=constrain(1+mouseHoldCount[i]/MOUSE_RAMP_SCALE, 1, MOUSE_MAX_PIXELS);
+        }  
+        if (keyCode == MOUSE_MOVE_LEFT)
+        {
+          left=constrain(1+mouseHoldCount[i]/MOUSE_RAMP_SCALE, 1, MOUSE_MAX_PIXELS);
+        }  
+        if (keyCode == MOUSE_MOVE_RIGHT)
+        {
+          right=constrain(1+mouseHoldCount[i]/MOUSE_RAMP_SCALE, 1, MOUSE_MAX_PIXELS);
+        }  
       }
     }
+  }
 
-    // diagonal scrolling and left/right cancellation
-    if(left > 0)
+  // diagonal scrolling and left/right cancellation
+  if(left > 0)
+  {
+    if(right > 0)
     {
-      if(right > 0)
-      {
-        horizmotion = 0; // cancel horizontal motion because left and right are both pushed
-      }
-      else
-      {
-        horizmotion = -left; // left yes, right no
-      }
+      horizmotion = 0; // cancel horizontal motion because left and right are both pushed
     }
     else
     {
-      if(right > 0)
-      {
-        horizmotion = right; // right yes, left no
-      }
+      horizmotion = -left; // left yes, right no
+    }
+  }
+  else
+  {
+    if(right > 0)
+    {
+      horizmotion = right; // right yes, left no
     }
+  }
 
-    if(down > 0)
+  if(down > 0)
+  {
+    if(up > 0)
     {
-      if(up > 0)
-      {
-        vertmotion = 0; // cancel vertical motion because up and down are both pushed
-      }
-      else
-      {
-        vertmotion = down; // down yes, up no
-      }
+      vertmotion = 0; // cancel vertical motion because up and down are both pushed
     }
     else
     {
-      if (up > 0)
-      {
-        vertmotion = -up; // up yes, down no
-      }
+      vertmotion = down; // down yes, up no
     }
-    // now move the mouse
-    if( !((horizmotion == 0) && (vertmotion==0)) )
+  }
+  else
+  {
+    if (up > 0)
     {
-      makeyMate.moveMouse(0, horizmotion * PIXELS_PER_MOUSE_STEP, vertmotion * PIXELS_PER_MOUSE_STEP);
+      vertmotion = -up; // up yes, down no
     }
   }
+  // now move the mouse
+  if( !((horizmotion == 0) && (vertmotion==0)) )
+  {
+    makeyMate.moveMouse(0, horizmotion * PIXELS_PER_MOUSE_STEP, vertmotion * PIXELS_PER_MOUSE_STEP);
+  }
 }
 
 ///////////////////////////
-// ADD DELAY //////////////
-///// Loop: Step 9 ////////
+// SERVICE CONSOLE ////////
+///// Console task ////////
 ///////////////////////////
-void addDelay() {
+/* Single character commands from the USB serial monitor:
+   E - start/stop streaming the event log (binary, see eventLog.cpp) 
+   T - print the link telemetry counters
+   S - print the scheduler's task timing
+   M - print SRAM use, stack high-water mark and buffer sizes
+ The event log is only sent while the host has the port open, a few
+ records per run so the loop timing isn't disturbed. */
+void serviceConsole()
+{
+  if (Serial.available())
+  {
+    switch (Serial.read())
+    {
+    case 'E':
+      eventStreaming = !eventStreaming;
+      break;
+    case 'T':
+      printLinkStats();
+      break;
+    case 'S':
+      printTaskStats();
+      break;
+    case 'M':
+      printMemoryStats();
+      break;
+    }
+  }
 
-  loopTime = micros() - prevTime;
-  
-  if (loopTime < TARGET_LOOP_TIME)
+  if (eventStreaming && Serial)
+  {
+    eventLog.drain(Serial, EVENTS_PER_RUN);
+  }
+}
+
+/* Prints each task's worst run time and deadline misses, one per line */
+void printTaskStats()
+{
+  for (byte t=0; t<NUM_TASKS; t++)
+  {
+    Serial.print("Task ");
+    Serial.print(t);
+    Serial.print(": worst ");
+    Serial.print(tasks[t].worst);
+    Serial.print(" us, ");
+    Serial.print(tasks[t].misses);
+    Serial.print(" misses, ");
+    Serial.print(tasks[t].skipped);
+    Serial.println(" skipped");
+  }
+}
+
+/* Prints makeyMate's link telemetry, one counter per line */
+void printLinkStats()
+{
+  makeyMateStats stats = makeyMate.getStats();
+
+  Serial.print("Keyboard reports: ");
+  Serial.print(stats.keyboardReports);
+  Serial.print(" (");
+  Serial.print(stats.keyboardBytes);
+  Serial.println(" bytes)");
+  Serial.print("Mouse reports: ");
+  Serial.print(stats.mouseReports);
+  Serial.print(" (");
+  Serial.print(stats.mouseBytes);
+  Serial.println(" bytes)");
+  Serial.print("Suppressed reports: ");
+  Serial.println(stats.suppressedReports);
+  Serial.print("Merged reports: ");
+  Serial.println(stats.mergedReports);
+  Serial.print("Rollover drops: ");
+  Serial.println(stats.rolloverDrops);
+  Serial.print("Displaced keys: ");
+  Serial.println(stats.displacedKeys);
+  Serial.print("Unmapped drops: ");
+  Serial.println(stats.unmappedDrops);
+  Serial.print("Most TX per link update: ");
+  Serial.print(stats.txMostPerUpdate);
+  Serial.print(" bytes in ");
+  Serial.print(LINK_UPDATE_TIME / 1000);
+  Serial.println(" ms");
+  Serial.print("Command timeouts: ");
+  Serial.println(stats.commandTimeouts);
+  Serial.print("Reconnects: ");
+  Serial.println(stats.reconnects);
+  Serial.print("Link faults: ");
+  Serial.println(stats.linkFaults);
+  Serial.print("Probes: ");
+  Serial.println(stats.probes);
+  Serial.print("Recoveries (command/reboot/fresh start): ");
+  Serial.print(stats.recoveries[0]);
+  Serial.print("/");
+  Serial.print(stats.recoveries[1]);
+  Serial.print("/");
+  Serial.println(stats.recoveries[2]);
+  Serial.print("Last/longest recovery: ");
+  Serial.print(stats.lastRecoveryTime);
+  Serial.print("/");
+  Serial.print(stats.longestRecoveryTime);
+  Serial.println(" ms");
+}
+
+///////////////////////////
+// MEMORY /////////////////
+///////////////////////////
+/* The 32U4 has 2.5 KB of SRAM: static variables at the bottom, then the
+ heap (unused unless something calls malloc), then free space, then the
+ stack growing down from RAMEND. paintStack() fills the free space with
+ STACK_PAINT before setup() runs. Bytes still painted later have never
+ been reached by the stack, so the deepest the stack has ever been is
+ where the paint stops. */
+#define STACK_PAINT  0xC5
+
+extern uint8_t _end;  // end of the static variables, from the linker
+extern char * __brkval;  // top of the heap, 0 if it's never been used
+
+/* Runs in .init3, after the stack pointer is set and before the static
+ variables are. Naked and never called, nothing is on the stack yet. */
+void paintStack() __attribute__ ((naked, used, section (".init3")));
+void paintStack()
+{
+  uint8_t * p = &_end;
+
+  while (p <= (uint8_t *) RAMEND)
+  {
+    *p++ = STACK_PAINT;
+  }
+}
+
+/* Returns how many bytes above heapTop still hold STACK_PAINT */
+unsigned int stackUnused(uint8_t * heapTop)
+{
+  uint8_t * p = heapTop;
+
+  while ((p < (uint8_t *) SP) && (*p == STACK_PAINT))
   {
-    int wait = TARGET_LOOP_TIME - loopTime;
-    delayMicroseconds(wait);
+    p++;
   }
+  return p - heapTop;
+}
 
-  prevTime = micros();
+void printMemoryStats()
+{
+  uint8_t * heapTop = (__brkval == 0) ? &_end : (uint8_t *) __brkval;
+  unsigned int unused = stackUnused(heapTop);
+
+  Serial.print("SRAM: ");
+  Serial.print(RAMEND - RAMSTART + 1);
+  Serial.println(" bytes");
+  Serial.print("Static: ");
+  Serial.println(&_end - (uint8_t *) RAMSTART);
+  Serial.print("Heap: ");
+  Serial.println(heapTop - &_end);
+  Serial.print("Stack now/most: ");
+  Serial.print(RAMEND - SP);
+  Serial.print("/");
+  Serial.println((uint8_t *) RAMEND - heapTop - unused);
+  Serial.print("Free now/least: ");
+  Serial.print((uint8_t *) SP - heapTop);
+  Serial.print("/");
+  Serial.println(unused);
+
+  Serial.println("Buffers:");
+  Serial.print(" inputs: ");
+  Serial.println(sizeof(inputs));
+  Serial.print(" mouseHoldCount: ");
+  Serial.println(sizeof(mouseHoldCount));
+  Serial.print(" tasks: ");
+  Serial.println(sizeof(tasks));
+  Serial.print(" eventLog: ");
+  Serial.println(sizeof(eventLog));
+  Serial.print(" makeyMate (rxBuffer, stats): ");
+  Serial.println(sizeof(makeyMate));
+  Serial.print(" gestures: ");
+  Serial.println(sizeof(gestures));
+  Serial.print(" bluetooth RX: ");
+  Serial.println(_SS_MAX_RX_BUFF);
 }
 
 ///////////////////////////
-// CYCLE LEDS /////////////
-/// Loop: Step 7 //////////
+// PET WATCHDOG ///////////
 ///////////////////////////
-void cycleLEDs() {
-  pinMode(inputLED_a, INPUT);
-  pinMode(inputLED_b, INPUT);
-  pinMode(inputLED_c, INPUT);
-  digitalWrite(inputLED_a, LOW);
-  digitalWrite(inputLED_b, LOW);
-  digitalWrite(inputLED_c, LOW);
+void petWatchdog()
+{
+  if (*BOOTLOADER_KEY_PTR != BOOTLOADER_KEY)  // let a bootloader reset through
+  {
+    wdt_reset();
+  }
+}
+
+///////////////////////////
+// SET LED STATE //////////
+///////////////////////////
+/* Drives the three charlieplex pins into one of the precomputed states.
+ Only the LED bits of PORTB/DDRB are touched. */
+void setLedState(byte state)
+{
+  PORTB = (PORTB & ~LED_PIN_MASK) | ledPort[state];
+  DDRB = (DDRB & ~LED_PIN_MASK) | ledDdr[state];
+}
+
+///////////////////////////
+// LED TIMER TICK /////////
+///////////////////////////
+/* Each tick lights the next of the six LEDs if its bit is set in ledMask.
+ While a dance is running, the current dance frame is shown instead and
+ advanced once its time is up. */
+ISR(TIMER3_COMPA_vect)
+{
+  static byte ledCycleCounter = 0;
+  static unsigned int danceTicks = 0;
+
+  if (danceFrame < DANCE_FRAMES)
+  {
+    unsigned int frameTime;
+    if (danceFrame < 16)
+    {
+      setLedState(danceCircle[danceFrame & 0x03]);
+      frameTime = DANCE_CIRCLE_TIME;
+    }
+    else
+    {
+      setLedState(danceWiggle[danceFrame & 0x01]);
+      frameTime = DANCE_WIGGLE_TIME;
+    }
+
+    danceTicks++;
+    if (danceTicks >= (frameTime * 1000UL) / LED_TICK_TIME)
+    {
+      danceTicks = 0;
+      danceFrame++;
+    }
+    return;
+  }
 
   ledCycleCounter++;
-  ledCycleCounter %= 6;
-
-  if ((ledCycleCounter == 0) && inputs[0].pressed) {
-    pinMode(inputLED_a, INPUT);
-    digitalWrite(inputLED_a, HIGH);
-    pinMode(inputLED_b, OUTPUT);
-    digitalWrite(inputLED_b, HIGH);
-    pinMode(inputLED_c, OUTPUT);
-    digitalWrite(inputLED_c, LOW);
-  }
-  if ((ledCycleCounter == 1) && inputs[1].pressed) {
-    pinMode(inputLED_a, OUTPUT);
-    digitalWrite(inputLED_a, HIGH);
-    pinMode(inputLED_b, OUTPUT);
-    digitalWrite(inputLED_b, LOW);
-    pinMode(inputLED_c, INPUT);
-    digitalWrite(inputLED_c, LOW);
-
-  }
-  if ((ledCycleCounter == 2) && inputs[2].pressed) {
-    pinMode(inputLED_a, OUTPUT);
-    digitalWrite(inputLED_a, LOW);
-    pinMode(inputLED_b, OUTPUT);
-    digitalWrite(inputLED_b, HIGH);
-    pinMode(inputLED_c, INPUT);
-    digitalWrite(inputLED_c, LOW);
-  }
-  if ((ledCycleCounter == 3) && inputs[3].pressed) {
-    pinMode(inputLED_a, INPUT);
-    digitalWrite(inputLED_a, LOW);
-    pinMode(inputLED_b, OUTPUT);
-    digitalWrite(inputLED_b, LOW);
-    pinMode(inputLED_c, OUTPUT);
-    digitalWrite(inputLED_c, HIGH);
-  }
-  if ((ledCycleCounter == 4) && inputs[4].pressed) {
-    pinMode(inputLED_a, OUTPUT);
-    digitalWrite(inputLED_a, LOW);
-    pinMode(inputLED_b, INPUT);
-    digitalWrite(inputLED_b, LOW);
-    pinMode(inputLED_c, OUTPUT);
-    digitalWrite(inputLED_c, HIGH);
-  }
-  if ((ledCycleCounter == 5) && inputs[5].pressed) {
-    pinMode(inputLED_a, OUTPUT);
-    digitalWrite(inputLED_a, HIGH);
-    pinMode(inputLED_b, INPUT);
-    digitalWrite(inputLED_b, LOW);
-    pinMode(inputLED_c, OUTPUT);
-    digitalWrite(inputLED_c, LOW);
+  if (ledCycleCounter == 6)
+  {
+    ledCycleCounter = 0;
   }
 
+  if (ledMask & (1<<ledCycleCounter))
+  {
+    setLedState(ledCycleCounter);
+  }
+  else
+  {
+    setLedState(LED_OFF);
+  }
+}
+
+///////////////////////////
+// UPDATE LEDS ////////////
+/// LED task //////////////
+///////////////////////////
+void updateLEDs()
+{
+  updateInputLEDs();  // U/D/L/R/Space/Click LEDs
+  updateOutLEDs();  // output LEDs (K/M)
+}
+
+void updateInputLEDs() 
+{
+  byte mask = 0;
+  for (int i=0; i<6; i++)
+  {
+    if (inputs[i].pressed)
+    {
+      mask |= (1<<i);
+    }
+  }
+  ledMask = mask;
 }
 
 /////////////////////////
 //// updateOutLEDs //////
-//// Loop: Step 8 ///////
+//// LED task ///////////
 /////////////////////////
 
 void updateOutLEDs()
@@ -585,7 +1235,7 @@ void updateOutLEDs()
       {
         keyPressed = 1;
       }
-      else
+      else if (inputs[i].isMouseMotion || inputs[i].isMouseButton)
       {
         mousePressed = 1;
       }
@@ -612,104 +1262,31 @@ void updateOutLEDs()
 }
 
 ///////////////////////////
-// DANCE LEDS  ////////////
+// START DANCE ////////////
 /// Setup /////////////////
 ///////////////////////////
-void danceLeds()
-{
-  int delayTime = 50;
-  int delayTime2 = 100;
-
-  // CIRCLE
-  for(int i=0; i<4; i++)
-  {
-    // UP
-    pinMode(inputLED_a, INPUT);
-    digitalWrite(inputLED_a, HIGH);
-    pinMode(inputLED_b, OUTPUT);
-    digitalWrite(inputLED_b, HIGH);
-    pinMode(inputLED_c, OUTPUT);
-    digitalWrite(inputLED_c, LOW);
-    delay(delayTime);
-
-    //RIGHT
-    pinMode(inputLED_a, INPUT);
-    digitalWrite(inputLED_a, LOW);
-    pinMode(inputLED_b, OUTPUT);
-    digitalWrite(inputLED_b, LOW);
-    pinMode(inputLED_c, OUTPUT);
-    digitalWrite(inputLED_c, HIGH);
-    delay(delayTime);
-
-
-    // DOWN
-    pinMode(inputLED_a, OUTPUT);
-    digitalWrite(inputLED_a, HIGH);
-    pinMode(inputLED_b, OUTPUT);
-    digitalWrite(inputLED_b, LOW);
-    pinMode(inputLED_c, INPUT);
-    digitalWrite(inputLED_c, LOW);
-    delay(delayTime);
-
-    // LEFT
-    pinMode(inputLED_a, OUTPUT);
-    digitalWrite(inputLED_a, LOW);
-    pinMode(inputLED_b, OUTPUT);    
-    digitalWrite(inputLED_b, HIGH);
-    pinMode(inputLED_c, INPUT);
-    digitalWrite(inputLED_c, LOW);
-    delay(delayTime);    
-  }    
-
-  // WIGGLE
-  for(int i=0; i<4; i++)
-  {
-    // SPACE
-    pinMode(inputLED_a, OUTPUT);
-    digitalWrite(inputLED_a, HIGH);
-    pinMode(inputLED_b, INPUT);
-    digitalWrite(inputLED_b, LOW);
-    pinMode(inputLED_c, OUTPUT);
-    digitalWrite(inputLED_c, LOW);
-    delay(delayTime2);    
-
-    // CLICK
-    pinMode(inputLED_a, OUTPUT);
-    digitalWrite(inputLED_a, LOW);
-    pinMode(inputLED_b, INPUT);
-    digitalWrite(inputLED_b, LOW);
-    pinMode(inputLED_c, OUTPUT);
-    digitalWrite(inputLED_c, HIGH);
-    delay(delayTime2);    
-  }
-}
-
-// This function checks if a recent key press is part of an
-// expected sequence of button presses. If the expected
-// sequence is received, we attempt to connect to a stored
-// remote address. By default the expected sequence is:
-// Up -> Down -> Left -> Right -> Space -> Click
-void checkSequence(int pressedKey, int * expectedSequence)
-{
-  buttonSequence[sequenceIndex] = pressedKey;
-  
-  for (int i=0; i<sequenceIndex + 1; i++)
-  {
-    if (buttonSequence[i] != expectedSequence[i])  // If not the correct sequence
-    {
-      sequenceIndex = 0;  // reset sequence index, start over
-      return;  // get outta here
-    }
-  }
-  sequenceIndex = (sequenceIndex++) % SEQUENCE_LENGTH;
-  if (sequenceIndex == SEQUENCE_LENGTH)
+/* Starts the LED dance. It doesn't block, the frames are stepped by the
+ LED timer, so the caller can get on with configuring the bluetooth
+ module and sampling inputs while it plays. */
+void startDance()
+{
+  danceFrame = 0;
+}
+
+// This function carries out the action of a gesture recognized by
+// gestures.press(). The gestures themselves are listed in settings.h, 
+// by default Up -> Down -> Left -> Right -> Space -> Click attempts 
+// to connect to a stored remote address.
+void runGestureAction(byte action)
+{
+  switch (action)
   {
-    danceLeds();  // good to indicate sequence was reeived
+  case GESTURE_RECONNECT:
+    startDance();  // good to indicate gesture was received
     makeyMate.connect();  // attempt to connect
-    sequenceIndex = 0;
+    break;
+  case GESTURE_NEXT_LAYER:
+    setLayer(activeLayer + 1);
+    break;
   }
 }
-
-
-
-
@@ -13,11 +13,147 @@
  */
 #include "Arduino.h"	// Needed for delay
 #include "makeyMate.h"
+#include "eventLog.h"
 #include <SoftwareSerial.h>
 
 // We'll use software serial to communicate with the bluetooth module
 SoftwareSerial bluetooth(14, 16);
 
+#define SHIFT 0x80
+/* HID scan codes for ASCII characters, stored in flash.
+   Read with pgm_read_byte(). */
+const uint8_t asciiToScanCode[128] PROGMEM =
+{
+  0x00,             // NUL
+  0x00,             // SOH
+  0x00,             // STX
+  0x00,             // ETX
+  0x00,             // EOT
+  0x00,             // ENQ
+  0x00,             // ACK  
+  0x00,             // BEL
+  0x2a,			// BS	Backspace
+  0x2b,			// TAB	Tab
+  0x28,			// LF	Enter
+  0x00,             // VT 
+  0x00,             // FF 
+  0x00,             // CR 
+  0x00,             // SO 
+  0x00,             // SI 
+  0x00,             // DEL
+  0x00,             // DC1
+  0x00,             // DC2
+  0x00,             // DC3
+  0x00,             // DC4
+  0x00,             // NAK
+  0x00,             // SYN
+  0x00,             // ETB
+  0x00,             // CAN
+  0x00,             // EM 
+  0x00,             // SUB
+  0x00,             // ESC
+  0x00,             // FS 
+  0x00,             // GS 
+  0x00,             // RS 
+  0x00,             // US 
+  0x2c,		   //  ' '
+  0x1e|SHIFT,	   // !
+  0x34|SHIFT,	   // "
+  0x20|SHIFT,    // #
+  0x21|SHIFT,    // $
+  0x22|SHIFT,    // %
+  0x24|SHIFT,    // &
+  0x34,          // '
+  0x26|SHIFT,    // (
+  0x27|SHIFT,    // )
+  0x25|SHIFT,    // *
+  0x2e|SHIFT,    // +
+  0x36,          // ,
+  0x2d,          // -
+  0x37,          // .
+  0x38,          // /
+  0x27,          // 0
+  0x1e,          // 1
+  0x1f,          // 2
+  0x20,          // 3
+  0x21,          // 4
+  0x22,          // 5
+  0x23,          // 6
+  0x24,          // 7
+  0x25,          // 8
+  0x26,          // 9
+  0x33|SHIFT,      // :
+  0x33,          // ;
+  0x36|SHIFT,      // <
+  0x2e,          // =
+  0x37|SHIFT,      // >
+  0x38|SHIFT,      // ?
+  0x1f|SHIFT,      // @
+  0x04|SHIFT,      // A
+  0x05|SHIFT,      // B
+  0x06|SHIFT,      // C
+  0x07|SHIFT,      // D
+  0x08|SHIFT,      // E
+  0x09|SHIFT,      // F
+  0x0a|SHIFT,      // G
+  0x0b|SHIFT,      // H
+  0x0c|SHIFT,      // I
+  0x0d|SHIFT,      // J
+  0x0e|SHIFT,      // K
+  0x0f|SHIFT,      // L
+  0x10|SHIFT,      // M
+  0x11|SHIFT,      // N
+  0x12|SHIFT,      // O
+  0x13|SHIFT,      // P
+  0x14|SHIFT,      // Q
+  0x15|SHIFT,      // R
+  0x16|SHIFT,      // S
+  0x17|SHIFT,      // T
+  0x18|SHIFT,      // U
+  0x19|SHIFT,      // V
+  0x1a|SHIFT,      // W
+  0x1b|SHIFT,      // X
+  0x1c|SHIFT,      // Y
+  0x1d|SHIFT,      // Z
+  0x2f,          // [
+  0x31,          // bslash
+  0x30,          // ]
+  0x23|SHIFT,    // ^
+  0x2d|SHIFT,    // _
+  0x35,          // `
+  0x04,          // a
+  0x05,          // b
+  0x06,          // c
+  0x07,          // d
+  0x08,          // e
+  0x09,          // f
+  0x0a,          // g
+  0x0b,          // h
+  0x0c,          // i
+  0x0d,          // j
+  0x0e,          // k
+  0x0f,          // l
+  0x10,          // m
+  0x11,          // n
+  0x12,          // o
+  0x13,          // p
+  0x14,          // q
+  0x15,          // r
+  0x16,          // s
+  0x17,          // t
+  0x18,          // u
+  0x19,          // v
+  0x1a,          // w
+  0x1b,          // x
+  0x1c,          // y
+  0x1d,          // z
+  0x2f|SHIFT,    // 
+  0x31|SHIFT,    // |
+  0x30|SHIFT,    // }
+  0x35|SHIFT,    // ~
+  0				// DEL
+};
+
 /* makeyMateClass constructor
  initializes the keyCodes variable and modifiers */
 makeyMateClass::makeyMateClass()
@@ -26,7 +162,28 @@ makeyMateClass::makeyMateClass()
   {
     keyCodes[i] = 0x00;
   }
+  heldCount = 0;
+  heldPriority = 0;
+  heldShift = 0;
+  keyShift = 0;
   modifiers = 0;
+  mouseButtons = 0;
+  usbActive = 0;
+  reportPending = 0;
+  mousePending = 0;
+  txBurst = 0;
+  memset(&stats, 0, sizeof(stats));
+  linkState = LINK_OK;
+  linkStep = 0;
+  linkDeadline = 0;
+  recoveryStart = 0;
+  lastSent = 0;
+  moduleName = 0;
+  configured = 0;
+  statusStrings = 0;
+  hostGone = 0;
+  statusNext = 0;
+  cmdMatched = 0;
 }
 
 /* begin(name)
@@ -34,18 +191,41 @@ makeyMateClass::makeyMateClass()
    for use with the MaKey MaKey.
    We set up authentication, sleep, special config settings. As well as
    seting the auto-connect mode. The name can also be configured with the 
-   *name* parameter. */
+   *name* parameter. 
+   If the module doesn't answer, the configuration is left to supervise(),
+   once it has recovered the module. */
 uint8_t makeyMateClass::begin(char * name)
 {
+  moduleName = name;
   bluetooth.begin(9600);  // Initialize the software serial port at 9600
   freshStart();  // Get the module into a known mode, non-command mode, not connected
 
+  uint8_t tries = BLUETOOTH_COMMAND_RETRIES;
   while (!enterCommandMode())  // Enter command mode
-      delay(100);    
+  {
+    if (--tries == 0)
+    {
+      linkFault();  // leave it to supervise(), so the inputs keep running
+      return 0;
+    }
+    delay(100);    
+  }
   delay(BLUETOOTH_RESPONSE_DELAY);
 
+  configure();
+
+  return 1;
+}
+
+/* configure() sends the MaKey MaKey's settings to the RN-42, which must
+   already be in command mode. Returns 1 if the module had to be rebooted
+   into HID mode, it's out of command mode then. */
+uint8_t makeyMateClass::configure(void)
+{
+  uint8_t rebooted = 0;
+
   setAuthentication(1);  // enable authentication
-  setName(name);  // Set the module name
+  setName(moduleName);  // Set the module name
   setMode(0);  // slave mode, worth trying mode 4 (auto dtr) as well 
   
   /* I'm torn on setting sleep mode. If you care about a low latency connection
@@ -58,6 +238,7 @@ uint8_t makeyMateClass::begin(char * name)
   /* These I wouldn't recommend changing. These settings are required for HID
      use and sending Keyboard and Mouse commands */
   setKeyboardMouseMode();  // bluetooth.println("SH,0030");
+  statusStrings = setStatusString();  // so supervise() knows when no host is connected
     
   // We must reboot if we're changing the mode to HID mode.
   // If you've already have the module in HID mode, this can be commented out
@@ -65,11 +246,16 @@ uint8_t makeyMateClass::begin(char * name)
   {
     setHIDMode();  // Set RN-42 to HID profile mode
     reboot();
+    rebooted = 1;
+    statusStrings = 1;  // SO,% took effect with the reboot
   }
   else
   {
-    Serial.println("Already in HID mode!");
+    LOG_INFO(LOG_HID_ALREADY, 0);
   }
+
+  configured = 1;
+  return rebooted;
 }
 
 /* enterCommandMode() will get the module into command mode if it's either
@@ -120,7 +306,7 @@ uint8_t makeyMateClass::getHIDMode(void)
  in non-command mode */
 void makeyMateClass::freshStart(void)
 {
-  int timeout = 1000;  // timeout, in the rare case the module is unresponsive
+  int tries = 0;  // \r's sent, gives up at 1000 in the rare case the module is unresponsive
   bluetooth.write((uint8_t) 0);	// Disconnects, if connected
   delay(BLUETOOTH_RESPONSE_DELAY);
   
@@ -129,11 +315,10 @@ void makeyMateClass::freshStart(void)
   do // This gets the module out of state 3
   {  // continuously send \r until there is a response, usually '?'
     bluetooth.write('\r');  
-    Serial.print("-");  // Debug info for how many \r's required to get a respsonse
-  } while ((!bluetooth.available()) && (timeout-- > 0));
+    tries++;
+  } while ((!bluetooth.available()) && (tries < 1000));
+  LOG_DEBUG(LOG_WAKE_TRIES, tries);  // how many \r's were required to get a response
   
-  while (bluetooth.available())
-    Serial.write(bluetooth.read());
   delay(BLUETOOTH_RESPONSE_DELAY);
   bluetooth.flush();  // delay and flush the receive buffer
   
@@ -154,14 +339,13 @@ uint8_t makeyMateClass::setKeyboardMouseMode(void)
   delay(BLUETOOTH_RESPONSE_DELAY);
   bluetoothReceive(rxBuffer);
 
-  /* Double check the setting, output results in Serial monitor */
+  /* Double check the setting, read back into the debug log. Asked even
+     when LOG_DEBUG is compiled out, so setup takes the same time. */
   bluetooth.flush();
   bluetooth.print("GH");
   bluetooth.write('\r');
   delay(BLUETOOTH_RESPONSE_DELAY);
-  Serial.print("HID Mode set to: ");
-  while (bluetooth.available())
-    Serial.write(bluetooth.read());
+  LOG_DEBUG(LOG_SET_HID_MODE, readValue());
 
   return bluetoothCheckReceive(rxBuffer, "AOK", 3);
 }
@@ -178,14 +362,12 @@ uint8_t makeyMateClass::setHIDMode(void)
   delay(BLUETOOTH_RESPONSE_DELAY);
   bluetoothReceive(rxBuffer);
 
-  /* Double check the setting, output results in Serial monitor */
+  /* Double check the setting, read back into the debug log */
   bluetooth.flush();
   bluetooth.print("G~");
   bluetooth.write('\r');
   delay(BLUETOOTH_RESPONSE_DELAY);
-  Serial.print("Profile set to: ");
-  while (bluetooth.available())
-    Serial.write(bluetooth.read());
+  LOG_DEBUG(LOG_SET_PROFILE, readValue());
 
   return bluetoothCheckReceive(rxBuffer, "AOK", 3);
 }
@@ -215,14 +397,12 @@ uint8_t makeyMateClass::setMode(uint8_t mode)
   delay(BLUETOOTH_RESPONSE_DELAY);  // Response will go to software serial buffer
   bluetoothReceive(rxBuffer);
 
-  /* Double check the setting, output results in Serial monitor */
+  /* Double check the setting, read back into the debug log */
   bluetooth.flush();
   bluetooth.print("GM");
   bluetooth.write('\r');
   delay(BLUETOOTH_RESPONSE_DELAY);
-  Serial.print("Mode set to: ");
-  while (bluetooth.available())
-    Serial.write(bluetooth.read());
+  LOG_DEBUG(LOG_SET_MODE, readValue());
 
   return bluetoothCheckReceive(rxBuffer, "AOK", 3);  
 }
@@ -247,14 +427,12 @@ uint8_t makeyMateClass::setSpecialConfig(uint8_t num)
   delay(BLUETOOTH_RESPONSE_DELAY);  // Response will go to software serial buffer
   bluetoothReceive(rxBuffer);
 
-  /* Double check the setting, output results in Serial monitor */
+  /* Double check the setting, read back into the debug log */
   bluetooth.flush();
   bluetooth.print("GQ");
   bluetooth.write('\r');
   delay(BLUETOOTH_RESPONSE_DELAY);
-  Serial.print("Special Config set to: ");
-  while (bluetooth.available())
-    Serial.write(bluetooth.read());
+  LOG_DEBUG(LOG_SET_SPECIAL, readValue());
 
   return bluetoothCheckReceive(rxBuffer, "AOK", 3);  
 }
@@ -276,14 +454,12 @@ uint8_t makeyMateClass::setSleepMode(char * sleepConfig)
   delay(BLUETOOTH_RESPONSE_DELAY);  // Response will go to software serial buffer
   bluetoothReceive(rxBuffer);
 
-  /* Double check the setting, output results in Serial monitor */
+  /* Double check the setting, read back into the debug log */
   bluetooth.flush();
   bluetooth.print("GW");
   bluetooth.write('\r');
   delay(BLUETOOTH_RESPONSE_DELAY);
-  Serial.print("Deep Sleep Mode set to: ");
-  while (bluetooth.available())
-    Serial.write(bluetooth.read());
+  LOG_DEBUG(LOG_SET_SLEEP, readValue());
 
   return bluetoothCheckReceive(rxBuffer, "AOK", 3);
 }
@@ -304,18 +480,42 @@ uint8_t makeyMateClass::setAuthentication(uint8_t authMode)
   delay(BLUETOOTH_RESPONSE_DELAY);  // Response will go to software serial buffer
   bluetoothReceive(rxBuffer);
 
-  /* Double check the setting, output results in Serial monitor */
+  /* Double check the setting, read back into the debug log */
   bluetooth.flush();
   bluetooth.print("GA");
   bluetooth.write('\r');
   delay(BLUETOOTH_RESPONSE_DELAY);
-  Serial.print("Authentication Mode set to: ");
-  while (bluetooth.available())
-    Serial.write(bluetooth.read());
+  LOG_DEBUG(LOG_SET_AUTH, readValue());
 
   return bluetoothCheckReceive(rxBuffer, "AOK", 3);
 }
 
+/* This function makes the RN-42 announce connections on its serial port,
+   "%CONNECT,<address>,..." and "%DISCONNECT", so supervise() can tell
+   when it's safe to probe it. Like the other settings, SO only takes 
+   effect after a reboot, so this returns 1 only if it was set already. */
+uint8_t makeyMateClass::setStatusString(void)
+{
+  bluetooth.flush();
+  bluetooth.print("GO");
+  bluetooth.write('\r');
+  delay(BLUETOOTH_RESPONSE_DELAY);
+  rxBuffer[0] = 0;
+  bluetoothReceive(rxBuffer);
+  if (rxBuffer[0] == '%')
+  {
+    return 1;
+  }
+
+  bluetooth.flush();
+  bluetooth.print("SO,%");
+  bluetooth.write('\r');
+  delay(BLUETOOTH_RESPONSE_DELAY);
+  bluetoothReceive(rxBuffer);
+  LOG_DEBUG(LOG_SET_STATUS, bluetoothCheckReceive(rxBuffer, "AOK", 3));
+  return 0;
+}
+
 /* This function sets the name of an RN-42 module
    name should be an up to 20-character value. It MUST BE TERMINATED by a 
    \r character */
@@ -337,16 +537,16 @@ uint8_t makeyMateClass::setName(char * name)
   delay(BLUETOOTH_RESPONSE_DELAY);
   bluetoothReceive(rxBuffer);
 
-  /* Double check the setting, output results in Serial monitor */
+  /* Double check the setting, read back into the debug log */
   bluetooth.flush();
   bluetooth.print("GN");
   bluetooth.write('\r');
   delay(BLUETOOTH_RESPONSE_DELAY);
-  Serial.print("Name set to: ");
-  while (bluetooth.available())
-    Serial.write(bluetooth.read());
+  bluetooth.flush();
 
-  return bluetoothCheckReceive(rxBuffer, "AOK", 3);
+  uint8_t ok = bluetoothCheckReceive(rxBuffer, "AOK", 3);
+  LOG_DEBUG(LOG_SET_NAME, ok);
+  return ok;
 }
 
 /* This function sends the HID report for mouse movement and clicks
@@ -355,6 +555,32 @@ uint8_t makeyMateClass::setName(char * name)
    parameters (x and y). */
 void makeyMateClass::moveMouse(uint8_t b, uint8_t x, uint8_t y)
 {
+  mouseButtons = b;
+  sendMouseReport(b, x, y);
+}
+
+/* This function sends a mouse report over whichever output is active,
+   native USB or the RN-42. */
+void makeyMateClass::sendMouseReport(uint8_t b, uint8_t x, uint8_t y)
+{
+#if defined(USBCON) && USB_HID_OUTPUT
+  if (usbActive)
+  {
+    uint8_t report[4] = {b, x, y, 0};  // buttons, x, y, wheel
+    HID_SendReport(1, report, 4);  // report id 1 is the mouse
+    stats.mouseReports++;
+    stats.mouseBytes += 4;
+    eventLog.record(EVENT_REPORT, 0xFD, b | (x << 8));
+    return;
+  }
+#endif
+
+  if (linkState != LINK_OK)
+  {
+    mousePending = 1;  // RN-42 is in command mode, or being recovered
+    return;
+  }
+
   bluetooth.write(0xFD);  // Send a RAW report
   bluetooth.write(5);  // length
   bluetooth.write(2);  // indicates a Mouse raw report
@@ -362,165 +588,642 @@ void makeyMateClass::moveMouse(uint8_t b, uint8_t x, uint8_t y)
   bluetooth.write((byte) x);  // x movement
   bluetooth.write((byte) y);  // y movement
   bluetooth.write((byte) 0);  // wheel movement NOT YET IMPLEMENTED
+  stats.mouseReports++;
+  stats.mouseBytes += 7;
+  txBurst += 7;
+  lastSent = millis();
+  eventLog.record(EVENT_REPORT, 0xFD, b | (x << 8));
+}
+
+/* This function sends the current keyboard report (modifiers and up to 
+   six keys) over whichever output is active. If empty is set, an all
+   keys released report is sent instead. */
+void makeyMateClass::sendKeyReport(uint8_t empty)
+{
+  uint8_t mods = empty ? 0 : (modifiers | keyShift);
+
+#if defined(USBCON) && USB_HID_OUTPUT
+  if (usbActive)
+  {
+    uint8_t report[8];
+    report[0] = mods;
+    report[1] = 0;  // reserved
+    for (int j=0; j<6; j++)
+    {
+      report[j + 2] = empty ? 0 : keyCodes[j];
+    }
+    HID_SendReport(2, report, 8);  // report id 2 is the keyboard
+    stats.keyboardReports++;
+    stats.keyboardBytes += 8;
+    eventLog.record(EVENT_REPORT, 0xFE, report[0] | (report[2] << 8));
+    return;
+  }
+#endif
+
+  if (linkState != LINK_OK)
+  {
+    reportPending = 1;  // RN-42 is being recovered, send it once it's back
+    return;
+  }
+
+  bluetooth.write(0xFE);	// Keyboard Shorthand Mode
+  bluetooth.write(0x07);	// Length
+  bluetooth.write(mods);	// Modifiers
+  for (int j=0; j<6; j++)
+  {
+    bluetooth.write(empty ? 0 : keyCodes[j]);  // up to six key codes, 0 is nothing
+  }
+  stats.keyboardReports++;
+  stats.keyboardBytes += 9;
+  txBurst += 9;
+  lastSent = millis();
+  eventLog.record(EVENT_REPORT, 0xFE, mods | ((empty ? 0 : keyCodes[0]) << 8));
+}
+
+/* This function picks the output for reports: native USB while the board
+   is enumerated by a computer, the RN-42 otherwise. Call it from the
+   link task, the bytes sent since the last call are counted here.
+   On a switch, everything is released on the old output and the keys
+   and buttons still held are sent on the new one, so nothing gets stuck
+   down on either host. */
+void makeyMateClass::updateOutput(void)
+{
+  if (txBurst > stats.txMostPerUpdate)
+  {
+    stats.txMostPerUpdate = txBurst;
+  }
+  txBurst = 0;
+
+#if defined(USBCON) && USB_HID_OUTPUT
+  uint8_t usb = USBDevice.configured() ? 1 : 0;
+
+  if (usb == usbActive)
+  {
+    return;
+  }
+
+  sendKeyReport(1);  // release everything on the old output
+  sendMouseReport(0, 0, 0);
+  usbActive = usb;
+  sendKeyReport(0);  // and send what's still held on the new one
+  reportPending = 0;
+  if (mouseButtons)
+  {
+    sendMouseReport(mouseButtons, 0, 0);
+  }
+#endif
 }
 
-/* This function sends a key press down. An array of pressed keys is 
-   generated and the RN-42 module is commanded to send a keyboard report.
+/* This function presses a key down. k is added to the held keys, and the
+   keyboard report is sent by the next sendReport(). Pressing a key that's
+   already down doesn't send anything.
    The k parameter should either be an HID usage value, or one of the key
-   codes provided for in settings.h
+   codes provided for in settings.h. The modifier keys (KEY_LEFT_CTRL to
+   KEY_RIGHT_GUI) set their bit in the report's modifier byte instead, 
+   and don't take up one of the six slots.
+   With priority set, the key is never left out of the report to make 
+   room for a newer one (see chooseKeys()).
    Does not release the key! */
-uint8_t makeyMateClass::keyPress(uint8_t k)
+uint8_t makeyMateClass::keyPress(uint8_t k, uint8_t priority)
 {
   uint8_t i;
+  uint8_t changed = 0;
+  uint8_t shifted = 0;
 
   if (k >= 136)  // Non printing key, these are listed in settings.h
   {
     k = k - 136;
   }
-  else if (k >= 128)  // !!! Modifiers, NOT YET IMPLEMENTED
+  else if (k >= 128)  // Modifiers, one bit each
   {
+    uint8_t bit = 1 << (k - 128);
+    queueKeyReport(!(modifiers & bit));
+    modifiers |= bit;
+    return 1;
   }
   else
   {
-    k = asciiToScanCode[k];
+    k = pgm_read_byte(&asciiToScanCode[k]);
     if (!k)
     {
+      stats.unmappedDrops++;
       return 0;
     }
 
     if (k & 0x80)
     {
-      modifiers |= 0x02;  // Adds the shift key to modifiers variable
+      shifted = 1;  // chooseKeys() adds the shift while the key's in the report
       k &= 0x7F;  // k can only be a 7-bit value.
     }
   }
 
-  /* generate the key report into the keyCodes array 
-     we can send up to 6 key presses, first make sure k isn't already in there */
-  if (keyCodes[0] != k && keyCodes[1] != k && 
-    keyCodes[2] != k && keyCodes[3] != k &&
-    keyCodes[4] != k && keyCodes[5] != k) 
+  /* add k to the end of the held keys, first make sure it isn't already in there */
+  for (i=0; i<heldCount; i++)
   {
-
-    for (i=0; i<6; i++) // Add k to the next available array index
+    if (heldKeys[i] == k)
     {
-      if (keyCodes[i] == 0x00) 
-      {
-        keyCodes[i] = k;
-        break;
-      }
+      break;
     }
-    if (i == 6) // Too many characters to send
+  }
+  if (i == heldCount)
+  {
+    if (heldCount == ROLLOVER_KEYS)  // Too many keys held down
     {
+      stats.rolloverDrops++;
       return 0;
-    }	
+    }
+    if (priority)
+    {
+      heldPriority |= (1UL << heldCount);
+    }
+    if (shifted)
+    {
+      heldShift |= (1UL << heldCount);
+    }
+    heldKeys[heldCount++] = k;
+    changed |= chooseKeys();
   }
 
-  bluetooth.write(0xFE);	// Keyboard Shorthand Mode
-  bluetooth.write(0x07);	// Length
-  bluetooth.write(modifiers);	// Modifiers
-  for (int j=0; j<6; j++)
-  {
-    bluetooth.write(keyCodes[j]);  // up to six key codes, 0 is nothing
-  }
+  queueKeyReport(changed);
 
   return 1;
 }
 
 /* This function releases a key press down. If it's there, k will be removed
-   from the keyCodes array, then that new array is sent to the RN-42 which
-   is commanded to send a keyboard report.
+   from the held keys, and the new report is sent by the next 
+   sendReport().
    The k parameter should either be an HID usage value, or one of the key
    codes provided for in settings.h */
 uint8_t makeyMateClass::keyRelease(uint8_t k)
 {
   uint8_t i;
+  uint8_t changed = 0;
 
   if (k >= 136)  // Non printing key
   {
     k = k - 136;
   }
-  else if (k >= 128)  // !!! Modifiers, todo !!!
+  else if (k >= 128)  // Modifiers
   {
+    uint8_t bit = 1 << (k - 128);
+    queueKeyReport(modifiers & bit);
+    modifiers &= ~bit;
+    return 1;
   }
   else
   {
-    k = asciiToScanCode[k];
+    k = pgm_read_byte(&asciiToScanCode[k]);
     if (!k)
     {
       return 0;
     }
 
-    if (k & 0x80)
+    k &= 0x7F;  // the shift goes with the key, see chooseKeys()
+  }
+
+  for (i=0; i<heldCount; i++) 
+  {
+    if ((0 != k) && (heldKeys[i] == k))
     {
-      modifiers &= ~0x02;	// Clear the modifier
-      k &= 0x7F;
+      unsigned long below = (1UL << i) - 1;
+      heldPriority = (heldPriority & below) | ((heldPriority >> 1) & ~below);
+      heldShift = (heldShift & below) | ((heldShift >> 1) & ~below);
+      heldCount--;
+      for (; i<heldCount; i++)  // close the gap, keeping the order
+      {
+        heldKeys[i] = heldKeys[i + 1];
+      }
+      changed |= chooseKeys();
+      break;
     }
   }
+  queueKeyReport(changed);
+
+  return 1;
+}
+
+/* This function picks which of the held keys go in the six slots of the
+   keyboard report, when more than six are down:
+   1) keys pressed with priority, oldest first
+   2) then the rest, newest first
+   so a new press always shows up (unless six priority keys are held), 
+   taking the place of the oldest one. Keys that stay in the report keep
+   their slot, and a key that's left out comes back as soon as there's 
+   room. The host only knows what's in the report, so to the host a key
+   that's left out has been released, and it's pressed again when it
+   comes back. 
+   Shifted characters (like '!') add shift to the report while one of them
+   is in it, on top of any modifier keys held. A report has one shift for
+   all its keys, so an unshifted key sent alongside comes out shifted too.
+   Returns 1 if the report changed. */
+uint8_t makeyMateClass::chooseKeys(void)
+{
+  uint8_t chosen[6];
+  uint8_t count = 0;
+  uint8_t changed = 0;
+  uint8_t shift = 0;
+  int i, j;
 
-  for (i=0; i<6; i++) 
+  for (i=0; (i<heldCount) && (count<6); i++)
   {
-    if ((0 != k) && (keyCodes[i] == k))
+    if (heldPriority & (1UL << i))
     {
-      keyCodes[i] = 0x00;  // set the value that was k to 0
+      chosen[count++] = heldKeys[i];
+      shift |= (heldShift & (1UL << i)) ? 0x02 : 0;
     }
   }
-  /* send the new report: */
-  bluetooth.write(0xFE);	// Keyboard Shorthand Mode
-  bluetooth.write(0x07);	// Length
-  bluetooth.write(modifiers);	// Modifiers
-  for (int j=0; j<6; j++)
+  for (i=heldCount-1; (i>=0) && (count<6); i--)
+  {
+    if (!(heldPriority & (1UL << i)))
+    {
+      chosen[count++] = heldKeys[i];
+      shift |= (heldShift & (1UL << i)) ? 0x02 : 0;
+    }
+  }
+  if (shift != keyShift)
   {
-    bluetooth.write(keyCodes[j]);  // 6 possible scan codes
+    keyShift = shift;
+    changed = 1;
   }
 
-  return 1;
+  /* empty the slots of keys that are released, or left out */
+  for (j=0; j<6; j++)
+  {
+    if (keyCodes[j] == 0x00)
+    {
+      continue;
+    }
+    for (i=0; (i<count) && (chosen[i] != keyCodes[j]); i++)
+      ;
+    if (i == count)
+    {
+      for (i=0; (i<heldCount) && (heldKeys[i] != keyCodes[j]); i++)
+        ;
+      if (i < heldCount)  // still held, pushed out by a newer key
+      {
+        stats.displacedKeys++;
+      }
+      keyCodes[j] = 0x00;
+      changed = 1;
+    }
+  }
+
+  /* and put the newly chosen ones in the empty slots */
+  for (i=0; i<count; i++)
+  {
+    for (j=0; (j<6) && (keyCodes[j] != chosen[i]); j++)
+      ;
+    if (j < 6)
+    {
+      continue;  // already in the report
+    }
+    for (j=0; keyCodes[j] != 0x00; j++)
+      ;
+    keyCodes[j] = chosen[i];
+    changed = 1;
+  }
+
+  return changed;
+}
+
+/* This function marks the keyboard report as needing to be sent if it
+   changed. Several changes before the next sendReport() go out as one
+   report, and an unchanged report isn't sent at all. */
+void makeyMateClass::queueKeyReport(uint8_t changed)
+{
+  if (!changed)
+  {
+    stats.suppressedReports++;
+  }
+  else if (reportPending)
+  {
+    stats.mergedReports++;
+  }
+  else
+  {
+    reportPending = 1;
+  }
+}
+
+/* This function sends the keyboard report, if any key has been pressed or
+   released since the last call. Call it once per loop, after all the 
+   keyPress() and keyRelease() calls. */
+void makeyMateClass::sendReport(void)
+{
+  if (reportPending && (usbActive || (linkState == LINK_OK)))
+  {
+    reportPending = 0;
+    sendKeyReport(0);
+  }
+}
+
+/* This function is called when the RN-42 doesn't answer. It starts the
+   staged recovery in supervise(), unless one is already running. */
+void makeyMateClass::linkFault(void)
+{
+  if ((linkState != LINK_OK) && (linkState != LINK_PROBE))
+  {
+    return;
+  }
+  LOG_ERROR(LOG_LINK_FAULT, 0);
+  stats.linkFaults++;
+  recoveryStart = millis();
+  linkState = LINK_STAGE_COMMAND;
+  linkStep = 0;
+  linkDeadline = recoveryStart;
+}
+
+/* This function sends "$$$" and starts waiting for the module to answer
+   with "CMD" (or "?" if it's already in command mode). */
+void makeyMateClass::startVerify(unsigned long now)
+{
+  bluetooth.flush();
+  bluetooth.print("$$$");
+  bluetooth.write('\r');
+  cmdMatched = 0;
+  linkStep = LINK_STEP_VERIFY;
+  linkDeadline = now + BLUETOOTH_RESPONSE_TIMEOUT;
+}
+
+/* supervise() recovers a hung RN-42 without stopping the rest of the 
+   sketch. Call it every loop, it never blocks. 
+   A module that hangs while nothing is being sent would otherwise go
+   unnoticed, so once no report has gone out for BLUETOOTH_PROBE_INTERVAL
+   it's probed: "$$$" must get an answer within BLUETOOTH_RESPONSE_TIMEOUT,
+   then "---" leaves command mode again. No answer is a fault. That's only
+   done while the module has said "%DISCONNECT" (see setStatusString()):
+   with a host connected, and the config timer run out, "$$$" would be 
+   typed on the host instead. Keyboard reports are held back during the
+   probe, and the mouse is brought up to date after it.
+   Each recovery stage is a
+   few timed steps, followed by a check that the module answers "$$$":
+   1) command mode: just check again
+   2) reboot: R,1 and wait BLUETOOTH_RESET_DELAY
+   3) fresh start: disconnect, leave command mode, wait BLUETOOTH_RESET_DELAY
+   If the module answers, it's told to reconnect and any held keys are
+   sent again. If begin() gave up before configuring the module, that's
+   done first, the one time supervise() blocks (about 2 s, 4 with the 
+   reboot into HID mode). If not, the next stage is tried, and after the last one
+   everything starts over after BLUETOOTH_RETRY_DELAY.
+   Returns 1 if the link is OK. */
+uint8_t makeyMateClass::supervise(void)
+{
+  unsigned long now = millis();
+
+  if (linkState == LINK_OK)
+  {
+    while (bluetooth.available())  // status strings, "%CONNECT..." or "%DISCONNECT"
+    {
+      char c = bluetooth.read();
+      if (statusNext && ((c == 'C') || (c == 'D')))
+      {
+        hostGone = (c == 'D');
+        LOG_INFO(LOG_HOST_LINK, !hostGone);
+      }
+      statusNext = (c == '%');
+    }
+    if (!statusStrings || !hostGone || reportPending || (now - lastSent < BLUETOOTH_PROBE_INTERVAL))
+    {
+      return 1;
+    }
+    stats.probes++;
+    linkState = LINK_PROBE;
+    startVerify(now);
+    return 1;
+  }
+
+  if (linkStep == LINK_STEP_VERIFY)
+  {
+    uint8_t answered = 0;
+    while (!answered && bluetooth.available())
+    {
+      char c = bluetooth.read();
+      if (c == "CMD"[cmdMatched])
+      {
+        cmdMatched++;
+      }
+      else
+      {
+        cmdMatched = (c == 'C');
+      }
+      answered = (cmdMatched == 3) || (c == '?');  // "CMD", or "?" if already in command mode
+    }
+    if (answered)
+    {
+      if (linkState == LINK_PROBE)
+      {
+        bluetooth.print("---");  // still there, back out of command mode
+        bluetooth.write('\r');
+        linkState = LINK_OK;
+        lastSent = now;
+        if (mousePending)
+        {
+          mousePending = 0;
+          sendMouseReport(mouseButtons, 0, 0);
+        }
+        return 1;
+      }
+      else
+      {
+        uint8_t rebooted = 0;
+        if (!configured)
+        {
+          delay(BLUETOOTH_RESPONSE_DELAY);
+          LOG_INFO(LOG_LATE_CONFIG, 0);
+          rebooted = configure();
+          now = millis();
+        }
+        if (!rebooted)
+        {
+          bluetooth.flush();
+          bluetooth.print("C");  // connect to the stored remote address, leaves command mode
+          bluetooth.write('\r');
+        }
+        hostGone = 0;  // a host may connect now, wait for it to say otherwise
+
+        unsigned long duration = now - recoveryStart;
+        stats.recoveries[linkState - LINK_STAGE_COMMAND]++;
+        stats.lastRecoveryTime = duration;
+        if (duration > stats.longestRecoveryTime)
+        {
+          stats.longestRecoveryTime = duration;
+        }
+        LOG_INFO(LOG_LINK_RECOVERED, min(duration, 65535UL));
+
+        linkState = LINK_OK;
+        lastSent = now;
+        reportPending = 1;  // bring the host up to date
+        if (mouseButtons || mousePending)
+        {
+          mousePending = 0;
+          sendMouseReport(mouseButtons, 0, 0);
+        }
+        return 1;
+      }
+    }
+    if ((long)(now - linkDeadline) < 0)
+    {
+      return 0;  // still waiting for an answer
+    }
+
+    stats.commandTimeouts++;
+    if (linkState == LINK_PROBE)
+    {
+      linkFault();  // the idle module stopped answering
+      return 0;
+    }
+    linkState++;  // no answer, escalate
+    linkStep = 0;
+    linkDeadline = now;
+    if (linkState == LINK_WAIT_RETRY)
+    {
+      linkDeadline = now + BLUETOOTH_RETRY_DELAY;
+    }
+    return 0;
+  }
+
+  if ((long)(now - linkDeadline) < 0)
+  {
+    return 0;  // current step isn't due yet
+  }
+
+  switch (linkState)
+  {
+  case LINK_STAGE_COMMAND:
+    startVerify(now);
+    break;
+
+  case LINK_STAGE_REBOOT:
+    if (linkStep == 0)
+    {
+      bluetooth.print("$$$");  // R,1 is only accepted in command mode
+      linkDeadline = now + BLUETOOTH_RESPONSE_DELAY;
+    }
+    else if (linkStep == 1)
+    {
+      bluetooth.print("R,1");  // reboot command
+      bluetooth.write('\r');
+      linkDeadline = now + BLUETOOTH_RESET_DELAY;
+    }
+    else
+    {
+      startVerify(now);
+      break;
+    }
+    linkStep++;
+    break;
+
+  case LINK_STAGE_FRESH:
+    if (linkStep == 0)
+    {
+      bluetooth.write((uint8_t) 0);  // Disconnects, if connected
+      linkDeadline = now + BLUETOOTH_RESPONSE_DELAY;
+    }
+    else if (linkStep == 1)
+    {
+      bluetooth.print("$$$");  // gets the module out of a stuck command mode
+      bluetooth.write('\r');
+      linkDeadline = now + BLUETOOTH_RESPONSE_DELAY;
+    }
+    else if (linkStep == 2)
+    {
+      bluetooth.flush();
+      bluetooth.print("---");  // exit command mode
+      bluetooth.write('\r');
+      linkDeadline = now + BLUETOOTH_RESET_DELAY;
+    }
+    else
+    {
+      startVerify(now);
+      break;
+    }
+    linkStep++;
+    break;
+
+  case LINK_WAIT_RETRY:
+    linkState = LINK_STAGE_COMMAND;
+    linkStep = 0;
+    break;
+  }
+
+  return 0;
+}
+
+/* This function returns a copy of the link telemetry counters */
+makeyMateStats makeyMateClass::getStats(void)
+{
+  return stats;
 }
 
 /* This function will attempt a connection to the stored remote address
    The first time you connect the the RN-42 HID, the master device will
    need to initiate the connection. The first time a connection is made
    the bluetooth address of the master device will be stored on the RN-42.
-   If no remote address is stored, a connection will not be made. */
+   If no remote address is stored, a connection will not be made. 
+   The module answering ends any recovery supervise() had in progress. */
 uint8_t makeyMateClass::connect()
 {
+  stats.reconnects++;
   freshStart();  // Get the module disconnected, and out of command mode
   
+  uint8_t tries = BLUETOOTH_COMMAND_RETRIES;
   while (!enterCommandMode())
   {  // Enter command mode
+    if (--tries == 0)
+    {
+      linkFault();
+      return 0;
+    }
     delay(BLUETOOTH_RESPONSE_DELAY);
   }
   delay(BLUETOOTH_RESPONSE_DELAY);
   bluetooth.flush();
+
+  if (linkState != LINK_OK)  // it answered, stop supervise() from escalating
+  {
+    linkState = LINK_OK;
+    reportPending = 1;
+  }
+  if (!configured)
+  {
+    LOG_INFO(LOG_LATE_CONFIG, 0);
+    if (configure())
+    {
+      hostGone = 0;
+      return 1;  // rebooted into HID mode, out of command mode, a paired host reconnects
+    }
+  }
   
-  /* get the remote address and print it in the serial monitor */
+  /* get the remote address, and log it */
   bluetooth.print("GR");  // Get the remote address
   bluetooth.write('\r');
   delay(BLUETOOTH_RESPONSE_DELAY);
   if (bluetooth.peek() == 'N')  // Might say "No remote address stored */
   {  // (bluetooth address is hex values only, so won'te start with 'N'.
-    Serial.println("Can't connect. No paired device!");
+    LOG_ERROR(LOG_NO_PAIRED, 0);
     bluetooth.flush();
     bluetooth.print("---");  // exit command mode
     bluetooth.write('\r');
+    hostGone = 1;  // freshStart() disconnected it, a new host says "%CONNECT"
     return 0;  // No connect is attempted
   }
   else if (bluetooth.available() == 0)  
-  { // If we can't communicate with the module at all, print error
-    Serial.println("ERROR!");
+  { // If we can't communicate with the module at all, log an error
+    LOG_ERROR(LOG_NO_RESPONSE, 0);
+    stats.commandTimeouts++;
+    linkFault();
     return 0;  // return error
   }
-  /* otherwise print the address we're trying to connect to */
-  Serial.print("Attempting to connect to: ");
-  while (bluetooth.available())
-    Serial.write(bluetooth.read());
+  /* otherwise log the address we're trying to connect to */
+  LOG_INFO(LOG_CONNECTING, readValue());
+  bluetooth.flush();
     
   /* Attempt to connect */
   bluetooth.print("C");  // The connect command
   bluetooth.write('\r');
+  hostGone = 0;
   delay(BLUETOOTH_RESPONSE_DELAY);
-  while (bluetooth.available())
-    Serial.write(bluetooth.read());  // Should print "TRYING"
+  bluetooth.flush();  // Should say "TRYING"
   
   return 1;
 }
@@ -542,6 +1245,24 @@ uint8_t makeyMateClass::reboot(void)
   return bluetoothCheckReceive(rxBuffer, "Reboot!", 7);
 }
 
+/* This function reads the module's answer to a get command (GH, GM...)
+   and returns its last four hex digits, e.g. 0x0030 for "0030". */
+uint16_t makeyMateClass::readValue(void)
+{
+  uint16_t value = 0;
+
+  while (bluetooth.available())
+  {
+    char c = bluetooth.read();
+    if ((c >= '0') && (c <= '9'))
+      value = (value << 4) | (c - '0');
+    else if ((c >= 'A') && (c <= 'F'))
+      value = (value << 4) | (c - 'A' + 10);
+  }
+
+  return value;
+}
+
 /* This function reads all available characters on the bluetooth RX line
    into the dest array. It'll exit on either timeout, or if the 0x0A 
    (new line) character is received. */
@@ -562,6 +1283,10 @@ uint8_t makeyMateClass::bluetoothReceive(char * dest)
     }
   }
 
+  if (!timeout)
+  {
+    stats.commandTimeouts++;
+  }
   return timeout;
 }
 
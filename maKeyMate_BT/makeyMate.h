@@ -7,150 +7,80 @@
  in your own projects. If you find it helpful, buy me a beer next time you see me
  at the local pub.
  
- Defines HID scan codes for ASCII characters
  Definition for makeyMateClass class.
  */
 
 #ifndef makeyMate_H
 #define makeyMate_H
 
-#define SHIFT 0x80
-const uint8_t asciiToScanCode[128] =
-{
-  0x00,             // NUL
-  0x00,             // SOH
-  0x00,             // STX
-  0x00,             // ETX
-  0x00,             // EOT
-  0x00,             // ENQ
-  0x00,             // ACK  
-  0x00,             // BEL
-  0x2a,			// BS	Backspace
-  0x2b,			// TAB	Tab
-  0x28,			// LF	Enter
-  0x00,             // VT 
-  0x00,             // FF 
-  0x00,             // CR 
-  0x00,             // SO 
-  0x00,             // SI 
-  0x00,             // DEL
-  0x00,             // DC1
-  0x00,             // DC2
-  0x00,             // DC3
-  0x00,             // DC4
-  0x00,             // NAK
-  0x00,             // SYN
-  0x00,             // ETB
-  0x00,             // CAN
-  0x00,             // EM 
-  0x00,             // SUB
-  0x00,             // ESC
-  0x00,             // FS 
-  0x00,             // GS 
-  0x00,             // RS 
-  0x00,             // US 
-  0x2c,		   //  ' '
-  0x1e|SHIFT,	   // !
-  0x34|SHIFT,	   // "
-  0x20|SHIFT,    // #
-  0x21|SHIFT,    // $
-  0x22|SHIFT,    // %
-  0x24|SHIFT,    // &
-  0x34,          // '
-  0x26|SHIFT,    // (
-  0x27|SHIFT,    // )
-  0x25|SHIFT,    // *
-  0x2e|SHIFT,    // +
-  0x36,          // ,
-  0x2d,          // -
-  0x37,          // .
-  0x38,          // /
-  0x27,          // 0
-  0x1e,          // 1
-  0x1f,          // 2
-  0x20,          // 3
-  0x21,          // 4
-  0x22,          // 5
-  0x23,          // 6
-  0x24,          // 7
-  0x25,          // 8
-  0x26,          // 9
-  0x33|SHIFT,      // :
-  0x33,          // ;
-  0x36|SHIFT,      // <
-  0x2e,          // =
-  0x37|SHIFT,      // >
-  0x38|SHIFT,      // ?
-  0x1f|SHIFT,      // @
-  0x04|SHIFT,      // A
-  0x05|SHIFT,      // B
-  0x06|SHIFT,      // C
-  0x07|SHIFT,      // D
-  0x08|SHIFT,      // E
-  0x09|SHIFT,      // F
-  0x0a|SHIFT,      // G
-  0x0b|SHIFT,      // H
-  0x0c|SHIFT,      // I
-  0x0d|SHIFT,      // J
-  0x0e|SHIFT,      // K
-  0x0f|SHIFT,      // L
-  0x10|SHIFT,      // M
-  0x11|SHIFT,      // N
-  0x12|SHIFT,      // O
-  0x13|SHIFT,      // P
-  0x14|SHIFT,      // Q
-  0x15|SHIFT,      // R
-  0x16|SHIFT,      // S
-  0x17|SHIFT,      // T
-  0x18|SHIFT,      // U
-  0x19|SHIFT,      // V
-  0x1a|SHIFT,      // W
-  0x1b|SHIFT,      // X
-  0x1c|SHIFT,      // Y
-  0x1d|SHIFT,      // Z
-  0x2f,          // [
-  0x31,          // bslash
-  0x30,          // ]
-  0x23|SHIFT,    // ^
-  0x2d|SHIFT,    // _
-  0x35,          // `
-  0x04,          // a
-  0x05,          // b
-  0x06,          // c
-  0x07,          // d
-  0x08,          // e
-  0x09,          // f
-  0x0a,          // g
-  0x0b,          // h
-  0x0c,          // i
-  0x0d,          // j
-  0x0e,          // k
-  0x0f,          // l
-  0x10,          // m
-  0x11,          // n
-  0x12,          // o
-  0x13,          // p
-  0x14,          // q
-  0x15,          // r
-  0x16,          // s
-  0x17,          // t
-  0x18,          // u
-  0x19,          // v
-  0x1a,          // w
-  0x1b,          // x
-  0x1c,          // y
-  0x1d,          // z
-  0x2f|SHIFT,    // 
-  0x31|SHIFT,    // |
-  0x30|SHIFT,    // }
-  0x35|SHIFT,    // ~
-  0				// DEL
-};
-
 // Delay for bluetooth module after responding with "AOK"
 #define BLUETOOTH_RESPONSE_DELAY 100  // delay in ms
 #define BLUETOOTH_RESET_DELAY  2000  // delay in ms
 
+// Link supervision, see supervise()
+#define BLUETOOTH_COMMAND_RETRIES  10    // tries at command mode before the link is declared faulty
+#define BLUETOOTH_RESPONSE_TIMEOUT 500   // ms to wait for "CMD" when checking the module
+#define BLUETOOTH_RETRY_DELAY      5000  // ms to wait before starting recovery over again
+#define BLUETOOTH_PROBE_INTERVAL   10000 // ms without a report before an idle, disconnected module is checked
+
+// Link states, LINK_OK or the recovery stage in progress
+#define LINK_OK             0
+#define LINK_STAGE_COMMAND  1  // just try command mode again
+#define LINK_STAGE_REBOOT   2  // reboot the module with R,1
+#define LINK_STAGE_FRESH    3  // disconnect and reset, like freshStart()
+#define LINK_WAIT_RETRY     4  // all stages failed, wait and start over
+#define LINK_PROBE          5  // checking that an idle, disconnected module still answers
+#define LINK_STEP_VERIFY    0xFF  // waiting for the module to answer "$$$"
+
+// Log message codes, the id of LOG_ERROR/INFO/DEBUG records (see eventLog.h)
+#define LOG_HID_ALREADY     1   // begin(): the module was already in HID mode
+#define LOG_WAKE_TRIES      2   // freshStart(): data: \r's sent before the module answered
+#define LOG_SET_HID_MODE    3   // data: value read back with GH
+#define LOG_SET_PROFILE     4   // data: value read back with G~
+#define LOG_SET_MODE        5   // data: value read back with GM
+#define LOG_SET_SPECIAL     6   // data: value read back with GQ
+#define LOG_SET_SLEEP       7   // data: value read back with GW
+#define LOG_SET_AUTH        8   // data: value read back with GA
+#define LOG_SET_NAME        9   // data: 1 if the module answered AOK
+#define LOG_LINK_FAULT      10  // the module stopped answering, recovery started
+#define LOG_LINK_RECOVERED  11  // data: recovery time in ms
+#define LOG_NO_PAIRED       12  // connect(): no remote address stored
+#define LOG_NO_RESPONSE     13  // connect(): no answer to GR
+#define LOG_CONNECTING      14  // connect(): data: last 4 hex digits of the remote address
+#define LOG_LATE_CONFIG     15  // begin() gave up, configured after recovery or by connect()
+#define LOG_SET_STATUS      16  // data: 1 if the module answered AOK to SO,%
+#define LOG_HOST_LINK       17  // data: 1 = "%CONNECT" from the module, 0 = "%DISCONNECT"
+
+// Send reports over native USB instead of bluetooth while the MaKey MaKey
+// is plugged into (and enumerated by) a computer. 0 = bluetooth only.
+#define USB_HID_OUTPUT 1
+
+// Keys tracked while held down. A report only carries six of them, the
+// host sees the others as released, see chooseKeys() for which.
+#define ROLLOVER_KEYS  18
+
+// Link telemetry, see getStats()
+typedef struct {
+  unsigned long keyboardBytes;  // bytes sent in keyboard (0xFE) reports
+  unsigned long mouseBytes;  // bytes sent in mouse (0xFD) reports
+  unsigned int keyboardReports;  // keyboard reports sent
+  unsigned int mouseReports;  // mouse reports sent
+  unsigned int suppressedReports;  // keyboard reports skipped, nothing had changed
+  unsigned int mergedReports;  // key changes folded into the next report
+  unsigned int rolloverDrops;  // keyPress() calls dropped, ROLLOVER_KEYS keys already down
+  unsigned int displacedKeys;  // held keys left out of the report for a newer one
+  unsigned int unmappedDrops;  // keyPress() calls dropped, no scan code for the key
+  unsigned int txMostPerUpdate;  // most bytes sent to the RN-42 between two updateOutput() calls, there is no TX queue
+  unsigned int commandTimeouts;  // RN-42 commands that got no response
+  unsigned int reconnects;  // connect() attempts
+  unsigned int linkFaults;  // times the RN-42 stopped responding
+  unsigned int probes;  // liveness checks of the idle, disconnected RN-42, see supervise()
+  unsigned int recoveries[3];  // recoveries by stage: command mode, reboot, fresh start
+  unsigned long lastRecoveryTime;  // ms from fault to recovery, most recent
+  unsigned long longestRecoveryTime;  // ms from fault to recovery, worst so far
+} 
+makeyMateStats;
+
 class makeyMateClass
 {
 private:
@@ -161,9 +91,40 @@ private:
   uint8_t reboot(void);
   uint8_t bluetoothCheckReceive(char * src, char * expected, int bufferSize);
   uint8_t bluetoothReceive(char * dest);
+  uint16_t readValue(void);
   uint8_t setName(char * name);
+  uint8_t configure(void);
+  char * moduleName;
+  uint8_t configured;  // begin() got through the whole configuration
+  uint8_t setStatusString(void);
+  uint8_t statusStrings;  // the module reports "%CONNECT"/"%DISCONNECT", see setStatusString()
+  uint8_t hostGone;  // the module said "%DISCONNECT" and hasn't connected since
+  uint8_t statusNext;  // the last character from the module was a '%'
+  uint8_t cmdMatched;  // characters of "CMD" received so far, while verifying
   uint8_t keyCodes[6];
+  uint8_t heldKeys[ROLLOVER_KEYS];  // every key held down, oldest first
+  unsigned long heldPriority;  // bit i set: heldKeys[i] was pressed with priority
+  unsigned long heldShift;  // bit i set: heldKeys[i] is a shifted character, like '!'
+  uint8_t keyShift;  // 0x02 if a key in the report needs shift, see chooseKeys()
+  uint8_t heldCount;
   uint8_t modifiers;
+  uint8_t mouseButtons;
+  uint8_t usbActive;
+  uint8_t reportPending;
+  uint8_t mousePending;  // a mouse report was dropped while the RN-42 was busy
+  unsigned int txBurst;  // bytes sent to the RN-42 since the last updateOutput()
+  makeyMateStats stats;
+  uint8_t linkState;
+  uint8_t linkStep;
+  unsigned long linkDeadline;
+  unsigned long recoveryStart;
+  unsigned long lastSent;  // millis() of the last report sent to the RN-42
+  void linkFault(void);
+  void startVerify(unsigned long now);
+  void sendKeyReport(uint8_t empty);
+  void queueKeyReport(uint8_t changed);
+  uint8_t chooseKeys(void);
+  void sendMouseReport(uint8_t b, uint8_t x, uint8_t y);
   void freshStart(void);
   uint8_t setAuthentication(uint8_t authMode);
   uint8_t setSleepMode(char * sleepConfig);
@@ -175,9 +136,13 @@ public:
   makeyMateClass();
   uint8_t begin(char * name);
   uint8_t connect();
-  uint8_t keyPress(uint8_t k);
+  uint8_t keyPress(uint8_t k, uint8_t priority = 0);
   uint8_t keyRelease(uint8_t k);
   void moveMouse(uint8_t b, uint8_t x, uint8_t y);
+  void sendReport(void);
+  void updateOutput(void);
+  uint8_t supervise(void);
+  makeyMateStats getStats(void);
 };
 
 
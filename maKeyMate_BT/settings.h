@@ -11,50 +11,119 @@
     number, or symbol on your keyboard
   - you can also use codes for other keys such as modifier and function keys (see the
     the list of additional key codes at the bottom of this file)
+  - there are NUM_LAYERS complete layouts (layers). The board starts in layer 0, an input set
+    to LAYER_NEXT or a GESTURE_NEXT_LAYER gesture (see below) switches to the next one
+  - the table is stored in flash (PROGMEM), so it doesn't use up any RAM
 
 */
 
-int keyCodes[NUM_INPUTS] = {
-  // top side of the makey makey board
- 
-  /*KEY_UP_ARROW,     // up arrow pad
-  KEY_DOWN_ARROW,   // down arrow pad
-  KEY_LEFT_ARROW,   // left arrow pad
-  KEY_RIGHT_ARROW,  // right arrow pad
-  ' ',              // space button pad
-  MOUSE_LEFT,       // click button pad*/
-  
-  MOUSE_MOVE_UP,  // up arrow pad
-  MOUSE_MOVE_DOWN,  // down arrow pad
-  MOUSE_MOVE_LEFT,  // left arrow pad
-  MOUSE_MOVE_RIGHT, // right arrow pad
-  MOUSE_LEFT, //    // space button pad
-  MOUSE_RIGHT, // click button pad*/
-  
-  /*'w',  // up arrow pad
-  's',  // down arrow pad
-  'a',  // left arrow pad
-  'd',  // right arrow pad
-  ',',  // space button pad
-  '.',  // click button pad*/
-  
-  // female header on the back left side
-  
-  'w',                // pin D5
-  'a',                // pin D4
-  's',                // pin D3
-  'd',                // pin D2
-  'f',                // pin D1
-  'g',                // pin D0
-  
-  // female header on the back right side
+#define NUM_LAYERS 2
+
+const int keyCodes[NUM_LAYERS][NUM_INPUTS] PROGMEM = {
+  // LAYER 0: mouse on the front, keys and mouse on the back
+  {
+    // top side of the makey makey board
+    
+    MOUSE_MOVE_UP,      // up arrow pad
+    MOUSE_MOVE_DOWN,    // down arrow pad
+    MOUSE_MOVE_LEFT,    // left arrow pad
+    MOUSE_MOVE_RIGHT,   // right arrow pad
+    MOUSE_LEFT,         // space button pad
+    MOUSE_RIGHT,        // click button pad
+    
+    // female header on the back left side
+    
+    'w',                // pin D5
+    'a',                // pin D4
+    's',                // pin D3
+    'd',                // pin D2
+    'f',                // pin D1
+    'g',                // pin D0
+    
+    // female header on the back right side
+    
+    MOUSE_MOVE_UP,      // pin A5
+    MOUSE_MOVE_DOWN,    // pin A4
+    MOUSE_MOVE_LEFT,    // pin A3
+    MOUSE_MOVE_RIGHT,   // pin A2
+    MOUSE_LEFT,         // pin A1
+    MOUSE_RIGHT         // pin A0
+  },
   
-  MOUSE_MOVE_UP,      // pin A5
-  MOUSE_MOVE_DOWN,    // pin A4
-  MOUSE_MOVE_LEFT,    // pin A3
-  MOUSE_MOVE_RIGHT,   // pin A2
-  MOUSE_LEFT,         // pin A1
-  MOUSE_RIGHT         // pin A0
+  // LAYER 1: arrow keys on the front, for games
+  {
+    // top side of the makey makey board
+    
+    KEY_UP_ARROW,       // up arrow pad
+    KEY_DOWN_ARROW,     // down arrow pad
+    KEY_LEFT_ARROW,     // left arrow pad
+    KEY_RIGHT_ARROW,    // right arrow pad
+    ' ',                // space button pad
+    MOUSE_LEFT,         // click button pad
+    
+    /*'w',  // up arrow pad
+    's',  // down arrow pad
+    'a',  // left arrow pad
+    'd',  // right arrow pad
+    ',',  // space button pad
+    '.',  // click button pad*/
+    
+    // female header on the back left side
+    
+    'w',                // pin D5
+    'a',                // pin D4
+    's',                // pin D3
+    'd',                // pin D2
+    'f',                // pin D1
+    'g',                // pin D0
+    
+    // female header on the back right side
+    
+    MOUSE_MOVE_UP,      // pin A5
+    MOUSE_MOVE_DOWN,    // pin A4
+    MOUSE_MOVE_LEFT,    // pin A3
+    MOUSE_MOVE_RIGHT,   // pin A2
+    MOUSE_LEFT,         // pin A1
+    MOUSE_RIGHT         // pin A0
+  }
+};
+
+///////////////////////////
+// ROLLOVER ///////////////
+///////////////////////////
+/*
+  - a keyboard report holds six keys. When more than six are held down, the
+    newest six are sent, and an older key is sent again as soon as there's room.
+    The computer only sees the keys in the report: an older key that's pushed
+    out is released there, even though its pad is still held, and pressed
+    again when it comes back. Modifier keys (KEY_LEFT_CTRL...) don't count
+    towards the six
+  - a shifted character (like '!' or 'A') holds shift for the whole report while
+    it's in it, so keys held at the same time come out shifted too
+  - inputs set here always stay in the report instead, whatever else is pressed.
+    one bit per input, in the same order as keyCodes above (bit 0 = up arrow pad)
+  - for example 0x00030 keeps the space and click pads in
+*/
+#define ROLLOVER_PRIORITY  0x00000
+
+///////////////////////////
+// GESTURES ///////////////
+///////////////////////////
+/*
+  - each gesture is a list of inputs (0-17, in the same order as keyCodes above)
+    and the action to take when they're pressed
+  - GESTURE_SEQUENCE: press the inputs one after another, with no more than
+    timeout ms between each press
+  - GESTURE_CHORD: hold the inputs down together, all pressed within timeout ms
+  - actions: GESTURE_RECONNECT, GESTURE_NEXT_LAYER
+  - up to GESTURE_MAX_COUNT gestures, each up to GESTURE_MAX_LENGTH inputs long
+  - pick chords players won't hit by accident, e.g. not two arrows that games
+    press together
+*/
+const gesture gestureList[] = {
+  // type            action             timeout  length  inputs
+  {GESTURE_SEQUENCE, GESTURE_RECONNECT, 1000,    6,      {0, 1, 2, 3, 4, 5}},  // up->down->left->right->space->click
+  {GESTURE_CHORD,    GESTURE_NEXT_LAYER, 200,    3,      {0, 1, 5}}            // hold up+down+click together
 };
 
 ///////////////////////////
@@ -73,12 +142,55 @@ int keyCodes[NUM_INPUTS] = {
                                           // default value is 55
                                           // 100 = 5V (never use this high)
                                           // 0 = 0 V (never use this low
-                                          
+
+#define MAINS_FREQUENCY  56               // frequency of the mains hum to cancel, in Hz
+                                          // 24 samples are taken per mains cycle, so this sets the loop time
+                                          // use 50 or 60 to match your local mains, 56 (default) sits in between
+
+#define FILTER_MODE  FILTER_WINDOW        // FILTER_WINDOW: a press needs most of a mains cycle of contact, 20 of
+                                          // the last 24 samples with the defaults (14.9 ms at 56 Hz)
+                                          // FILTER_COMB: hum is cancelled by adding each sample to the one half a
+                                          // mains cycle earlier. A fresh contact has nothing to add to until it's
+                                          // half a cycle old, so a press is seen after 12 + 5 samples with the
+                                          // defaults (12.6 ms), not much sooner than the window
+                                          // releases are always confirmed by the full window
+
+#define COMB_WINDOW  6                    // FILTER_COMB only: sample pairs summed, between 1 and 11
+                                          // smaller = faster presses (never sooner than half a cycle),
+                                          // larger = better noise immunity
+
+#define COMB_PRESS_MARGIN_PERC  33        // FILTER_COMB only: how far above hum level the comb sum must be
+                                          // to press, in percent of COMB_WINDOW. Hum level follows
+                                          // SWITCH_THRESHOLD_CENTER_BIAS, like the window's threshold.
+                                          // The comb is fooled by less lopsided hum than the window: with the
+                                          // defaults it lets through a few presses a minute at 60% closed and
+                                          // about 100 at 65%, the window none up to 65% and a few at 70%.
+                                          // "make" in test/ prints both
+
+#define FAST_ATTACK  0                    // 1 = press the space pad and pins D0-D3 as soon as their contact
+                                          // edge is confirmed, rather than waiting for the filter. Only a contact
+                                          // made after a whole mains cycle open counts, hum is left to the filter
+                                          // (its first cycle still gets one short press). A press the window
+                                          // doesn't confirm is let go a mains cycle later. Best for rhythm/game
+                                          // setups where the player holds earth.
+
+#define FAST_ATTACK_CONFIRM  4            // FAST_ATTACK only: closed samples in a row needed after the edge
+
+
+/////////////////////////
+// IDLE /////////////////
+/////////////////////////
+#define IDLE_TIMEOUT         60           // seconds without contact on any input before sampling slows down
+                                          // and the MCU sleeps between samples, 0 = never go idle
+
+#define IDLE_SAMPLE_DIVIDER  8            // while idle, inputs are checked this many times less often
+                                          // the first touch is seen within one idle sample (8 = about 6 ms),
+                                          // then the usual filter runs at full rate
 
 /////////////////////////
 // MOUSE MOTION /////////
 /////////////////////////
-#define MOUSE_MOTION_UPDATE_INTERVAL  35   // how many loops to wait between 
+#define MOUSE_MOTION_UPDATE_INTERVAL  35   // how many samples to wait between 
                                            // sending mouse motion updates
                                            
 #define PIXELS_PER_MOUSE_STEP         4     // a larger number will make the mouse
@@ -0,0 +1,156 @@
+/*
+  filterReference.h
+
+ Reference model of the input filter, written straight from the
+ description in settings.h with no running sums or bit tricks: every
+ sum is counted again from the full sample history on every sample. It's
+ slow on purpose, filterTest.cpp checks the real kernels against it.
+ */
+
+#ifndef filterReference_H
+#define filterReference_H
+
+#include <math.h>
+#include <vector>
+
+#define WINDOW_SAMPLES  (BUFFER_LENGTH * 8)  // one mains cycle
+#define HALF_CYCLE      (WINDOW_SAMPLES / 2)
+
+class filterReference
+{
+private:
+  std::vector<int> history;  // every sample so far, 1 = closed
+
+  int sample(int age) const  // 0 = newest, open before the first sample
+  {
+    int n = (int) history.size() - 1 - age;
+    return (n >= 0) ? history[n] : 0;
+  }
+
+public:
+  int pressThreshold;
+  int releaseThreshold;
+  int combPressThreshold;
+  bool confirmed;  // FAST_ATTACK: a full press seen since the last press
+  int sincePress;  // FAST_ATTACK: samples since the last press, up to 255
+
+  filterReference(int offsetPerc, int centerBias, int combMarginPerc)
+  {
+    double center = WINDOW_SAMPLES * centerBias / 100.0;
+    double offset = WINDOW_SAMPLES * offsetPerc / 100.0;
+    pressThreshold = (int) floor(center + offset);
+    releaseThreshold = (int) floor(center - offset);
+    combPressThreshold = (int) floor(2 * COMB_WINDOW * centerBias / 100.0 + COMB_WINDOW * combMarginPerc / 100.0);
+    if (combPressThreshold > 2 * COMB_WINDOW - 1)
+    {
+      combPressThreshold = 2 * COMB_WINDOW - 1;
+    }
+    confirmed = false;
+    sincePress = 0;
+  }
+
+  void add(int closed)
+  {
+    history.push_back(closed ? 1 : 0);
+    if (windowSum() > pressThreshold)
+    {
+      confirmed = true;
+    }
+    if (sincePress < 255)
+    {
+      sincePress++;
+    }
+  }
+
+  // a new press is only confirmed if the window already says so
+  void markPressed()
+  {
+    confirmed = (windowSum() > pressThreshold);
+    sincePress = 0;
+  }
+
+  // a closed run that has just reached FAST_ATTACK_CONFIRM, within
+  // FAST_ATTACK_SETTLE samples of a closed sample that followed the rest 
+  // of a mains cycle open
+  bool fastAttackDetected() const
+  {
+    if (closedRun() != FAST_ATTACK_CONFIRM)
+    {
+      return false;
+    }
+    for (int start=0; start<FAST_ATTACK_SETTLE; start++)
+    {
+      bool quiet = (sample(start) == 1);
+      for (int age=start+1; quiet && (age<start+WINDOW_SAMPLES); age++)
+      {
+        quiet = (sample(age) == 0);
+      }
+      if (quiet)
+      {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // closed samples in the last mains cycle
+  int windowSum() const
+  {
+    int sum = 0;
+    for (int age=0; age<WINDOW_SAMPLES; age++)
+    {
+      sum += sample(age);
+    }
+    return sum;
+  }
+
+  // the last COMB_WINDOW samples, each added to the one half a cycle before
+  int combSum() const
+  {
+    int sum = 0;
+    for (int age=0; age<COMB_WINDOW; age++)
+    {
+      sum += sample(age) + sample(age + HALF_CYCLE);
+    }
+    return sum;
+  }
+
+  // closed samples in a row, up to 255
+  int closedRun() const
+  {
+    int run = 0;
+    while ((run < 255) && (run < (int) history.size()) && sample(run))
+    {
+      run++;
+    }
+    return run;
+  }
+
+  bool pressDetected() const
+  {
+    if (windowSum() > pressThreshold)
+    {
+      return true;
+    }
+    return (FILTER_MODE == FILTER_COMB) && (combSum() > combPressThreshold);
+  }
+
+  bool releaseDetected() const
+  {
+    if (FAST_ATTACK && !confirmed && (sincePress < WINDOW_SAMPLES))
+    {
+      return false;
+    }
+    if (windowSum() >= releaseThreshold)
+    {
+      return false;
+    }
+    if ((FILTER_MODE == FILTER_COMB) && (combSum() > combPressThreshold))
+    {
+      return false;
+    }
+    return true;
+  }
+};
+
+#endif	// filterReference_H
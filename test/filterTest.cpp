@@ -0,0 +1,513 @@
+/*
+  filterTest.cpp
+
+ Host-side differential test and benchmark for the input filter kernels
+ in inputFilter.h. Each kernel runs one sample at a time alongside the
+ reference model in filterReference.h. The running sums and the
+ pressed/released decisions must match on every sample.
+
+ The streams are:
+ - randomized ones, hum of random duty and phase with touches, contact
+   bounce and noise mixed in
+ - the stream files named on the command line (see streams/)
+
+ Then every kernel is timed over the same 18 inputs the board has, and
+ run through a sweep of hum duty cycles for its press latency and false
+ presses. Exits with 1 if anything differs from the reference, or hum
+ the filter rejects holds a pad down.
+
+ Built once per filter configuration by the Makefile.
+ */
+
+#ifndef FILTER_MODE
+#define FILTER_MODE  FILTER_WINDOW
+#endif
+#ifndef FAST_ATTACK
+#define FAST_ATTACK  0
+#endif
+#ifndef COMB_WINDOW
+#define COMB_WINDOW  6
+#endif
+#define BUFFER_LENGTH  3
+
+// the NOISE CANCELLATION defaults from settings.h
+#define SWITCH_THRESHOLD_OFFSET_PERC  5
+#define SWITCH_THRESHOLD_CENTER_BIAS  75
+#define COMB_PRESS_MARGIN_PERC        33
+#define FAST_ATTACK_CONFIRM           4
+
+#define NUM_INPUTS        18
+#define RANDOM_STREAMS    200
+#define RANDOM_SAMPLES    5000
+#define BENCHMARK_SAMPLES 200000
+#define SAMPLE_RATE       (56 * WINDOW_SAMPLES)  // samples per second at the default MAINS_FREQUENCY
+#define SWEEP_SAMPLES     20000   // per hum phase, when counting false presses
+#define SWEEP_PHASES      12
+#define SWEEP_TRIALS      48      // touches per duty cycle, when measuring latency
+#define SWEEP_MAX_HELD    1.0     // percent of the time hum may hold a pad down, up to SWEEP_REJECTED
+#if FILTER_MODE == FILTER_COMB
+#define SWEEP_REJECTED    60      // highest hum duty the comb rejects (FAST_ATTACK 0)
+#else
+#define SWEEP_REJECTED    65      // highest hum duty the window rejects (FAST_ATTACK 0)
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <chrono>
+#include "inputFilter.h"
+#include "filterReference.h"
+
+typedef std::vector<int> stream;
+
+///////////////////////////
+// STREAMS ////////////////
+///////////////////////////
+/* A random stream: open, with a few touches. A touch is hum (a square wave
+ one mains cycle long, with random duty and phase) or solid contact, with
+ a little bounce at each end. Random flips are sprinkled over all of it. */
+stream randomStream(int length)
+{
+  stream s(length, 0);
+  int n = rand() % 100;
+
+  while (n < length)
+  {
+    int touch = 10 + rand() % 400;
+    bool solid = (rand() % 3) == 0;
+    int duty = 20 + rand() % 70;  // percent of the cycle closed
+    int phase = rand() % WINDOW_SAMPLES;
+
+    for (int t=0; (t<touch) && (n<length); t++, n++)
+    {
+      if (solid)
+      {
+        s[n] = 1;
+      }
+      else
+      {
+        s[n] = ((t + phase) % WINDOW_SAMPLES) * 100 < duty * WINDOW_SAMPLES;
+      }
+      if ((t < 3) || (t > touch - 3))
+      {
+        s[n] = rand() & 1;  // bounce
+      }
+    }
+    n += 10 + rand() % 300;
+  }
+
+  for (int i=0; i<length; i++)
+  {
+    if ((rand() % 100) == 0)
+    {
+      s[i] ^= 1;
+    }
+  }
+  return s;
+}
+
+/* Reads a stream file: '0' and '1' are samples, "pattern*count" repeats a
+ run of them, and everything after '#' on a line is a comment. */
+bool readStream(const char * path, stream & s)
+{
+  FILE * file = fopen(path, "r");
+  if (!file)
+  {
+    return false;
+  }
+
+  char line[1024];
+  while (fgets(line, sizeof(line), file))
+  {
+    char * hash = strchr(line, '#');
+    if (hash)
+    {
+      *hash = 0;
+    }
+    char * token = strtok(line, " \t\r\n");
+    while (token)
+    {
+      std::string pattern = token;
+      int count = 1;
+      size_t star = pattern.find('*');
+      if (star != std::string::npos)
+      {
+        count = atoi(pattern.c_str() + star + 1);
+        pattern = pattern.substr(0, star);
+      }
+      for (int c=0; c<count; c++)
+      {
+        for (size_t i=0; i<pattern.size(); i++)
+        {
+          s.push_back(pattern[i] == '1');
+        }
+      }
+      token = strtok(NULL, " \t\r\n");
+    }
+  }
+
+  fclose(file);
+  return true;
+}
+
+///////////////////////////
+// DIFFERENTIAL CHECK /////
+///////////////////////////
+/* The press/release decisions, the way updateInputStates() and
+ checkFastAttack() make them. The sums come from either side. */
+template <class Side>
+bool decide(Side & side, bool pressed)
+{
+  if (!pressed)
+  {
+    if ((FAST_ATTACK && side.fastAttackDetected()) || side.pressDetected())
+    {
+      side.markPressed();
+      return true;
+    }
+    return false;
+  }
+  return !side.releaseDetected();
+}
+
+/* Wraps a kernel and one input's state, so decide() can treat it like
+ the reference */
+template <class Kernel>
+struct kernelSide
+{
+  Kernel * kernel;
+  filterState state;
+  int closedRun() { return state.closedRun; }
+  bool pressDetected() { return kernel->pressDetected(&state); }
+  bool releaseDetected() { return kernel->releaseDetected(&state); }
+  void markPressed() { kernel->markPressed(&state); }
+#if FAST_ATTACK
+  bool fastAttackDetected() { return kernel->fastAttackDetected(&state); }
+#else
+  bool fastAttackDetected() { return false; }
+#endif
+};
+
+/* Runs one stream through a kernel and the reference, returns the number
+ of samples where they disagreed (the first few are printed). */
+template <class Kernel>
+int checkStream(const char * kernelName, const char * streamName, const stream & s)
+{
+  Kernel kernel;
+  kernelSide<Kernel> side;
+  filterReference reference(SWITCH_THRESHOLD_OFFSET_PERC, SWITCH_THRESHOLD_CENTER_BIAS, COMB_PRESS_MARGIN_PERC);
+  bool kernelPressed = false;
+  bool referencePressed = false;
+  int mismatches = 0;
+
+  kernel.begin(SWITCH_THRESHOLD_OFFSET_PERC, SWITCH_THRESHOLD_CENTER_BIAS, COMB_PRESS_MARGIN_PERC);
+  kernel.reset(&side.state);
+  side.kernel = &kernel;
+
+  for (size_t n=0; n<s.size(); n++)
+  {
+    kernel.store(&side.state, s[n]);
+    kernel.sum(&side.state);
+    kernel.advance();
+    reference.add(s[n]);
+
+    kernelPressed = decide(side, kernelPressed);
+    referencePressed = decide(reference, referencePressed);
+
+    bool same = (side.state.bufferSum == reference.windowSum()) && (kernelPressed == referencePressed);
+    if (FILTER_MODE == FILTER_COMB)
+    {
+      same = same && (side.state.combSum == reference.combSum());
+    }
+    if (FAST_ATTACK)
+    {
+      same = same && (side.state.closedRun == reference.closedRun());
+      same = same && ((side.state.confirmed != 0) == reference.confirmed);
+      same = same && (side.state.sincePress == reference.sincePress);
+      same = same && (side.fastAttackDetected() == reference.fastAttackDetected());
+    }
+    if (!same)
+    {
+      if (mismatches < 5)
+      {
+        printf("  %s, %s, sample %d: window %d/%d comb %d/%d run %d/%d pressed %d/%d (kernel/reference)\n",
+          kernelName, streamName, (int) n,
+          side.state.bufferSum, reference.windowSum(),
+          side.state.combSum, reference.combSum(),
+          side.state.closedRun, reference.closedRun(),
+          kernelPressed, referencePressed);
+      }
+      mismatches++;
+    }
+  }
+  return mismatches;
+}
+
+/* Every stream through one kernel, returns the total mismatches */
+template <class Kernel>
+int checkKernel(const char * kernelName, const std::vector<stream> & streams, const std::vector<std::string> & names)
+{
+  int mismatches = 0;
+  for (size_t i=0; i<streams.size(); i++)
+  {
+    mismatches += checkStream<Kernel>(kernelName, names[i].c_str(), streams[i]);
+  }
+  printf("%s: %d streams, %d mismatches\n", kernelName, (int) streams.size(), mismatches);
+  return mismatches;
+}
+
+///////////////////////////
+// BENCHMARK //////////////
+///////////////////////////
+typedef std::chrono::steady_clock benchClock;
+volatile int benchSink;  // keeps the compiler from dropping the work
+
+/* Times a sample loop doing the first `steps` steps:
+ 0 = advance only, 1 = + store, 2 = + sum, 3 = + press/release decisions.
+ Returns nanoseconds per sample. */
+template <class Kernel>
+double timeSteps(int steps, const std::vector<uint32_t> & samples)
+{
+  Kernel kernel;
+  filterState states[NUM_INPUTS];
+  int decided = 0;
+
+  kernel.begin(SWITCH_THRESHOLD_OFFSET_PERC, SWITCH_THRESHOLD_CENTER_BIAS, COMB_PRESS_MARGIN_PERC);
+  for (int i=0; i<NUM_INPUTS; i++)
+  {
+    kernel.reset(&states[i]);
+  }
+
+  benchClock::time_point start = benchClock::now();
+  for (size_t n=0; n<samples.size(); n++)
+  {
+    uint32_t bits = samples[n];
+    if (steps >= 1)
+    {
+      for (int i=0; i<NUM_INPUTS; i++)
+      {
+        kernel.store(&states[i], (bits >> i) & 1);
+      }
+    }
+    if (steps >= 2)
+    {
+      for (int i=0; i<NUM_INPUTS; i++)
+      {
+        kernel.sum(&states[i]);
+      }
+    }
+    kernel.advance();
+    if (steps >= 3)
+    {
+      for (int i=0; i<NUM_INPUTS; i++)
+      {
+        decided += (i & 1) ? kernel.releaseDetected(&states[i]) : kernel.pressDetected(&states[i]);
+      }
+    }
+  }
+  double ns = std::chrono::duration<double, std::nano>(benchClock::now() - start).count();
+
+  for (int i=0; i<NUM_INPUTS; i++)
+  {
+    decided += states[i].bufferSum + states[i].combSum;
+  }
+  benchSink = decided;
+  return ns / samples.size();
+}
+
+/* Prints the cost of each kernel step, per sample (all inputs) and per
+ input. Each step is the difference between two runs, best of 5. */
+template <class Kernel>
+void benchmarkKernel(const char * kernelName)
+{
+  std::vector<uint32_t> samples(BENCHMARK_SAMPLES);
+  for (size_t n=0; n<samples.size(); n++)
+  {
+    samples[n] = (rand() ^ (rand() << 15)) & ((1UL << NUM_INPUTS) - 1);
+  }
+
+  double best[4];
+  for (int steps=0; steps<4; steps++)
+  {
+    best[steps] = 1e30;
+    for (int run=0; run<5; run++)
+    {
+      double ns = timeSteps<Kernel>(steps, samples);
+      if (ns < best[steps])
+      {
+        best[steps] = ns;
+      }
+    }
+  }
+
+  const char * names[4] = {"advance", "store", "sum", "press/release"};
+  printf("%s cost, ns per sample (per input):\n", kernelName);
+  for (int steps=0; steps<4; steps++)
+  {
+    double ns = (steps == 0) ? best[0] : best[steps] - best[steps - 1];
+    if (ns < 0)
+    {
+      ns = 0;
+    }
+    if (steps == 0)
+    {
+      printf("  %-14s %8.1f\n", names[steps], ns);
+    }
+    else
+    {
+      printf("  %-14s %8.1f (%.1f)\n", names[steps], ns, ns / NUM_INPUTS);
+    }
+  }
+  printf("  %-14s %8.1f\n", "total", best[3]);
+}
+
+///////////////////////////
+// HUM SWEEP //////////////
+///////////////////////////
+/* Hum of the given duty (percent closed) and phase, with 1% noise */
+int humSample(int n, int duty, int phase)
+{
+  int closed = ((n + phase) % WINDOW_SAMPLES) * 100 < duty * WINDOW_SAMPLES;
+  if ((rand() % 100) == 0)
+  {
+    closed ^= 1;
+  }
+  return closed;
+}
+
+/* For hum duty cycles from 30% to 95%, prints:
+ - false presses per minute on a pad that only sees the hum
+ - how much of the time the hum holds that pad down
+ - the average latency of a solid press made while the hum is there,
+   over the touches that weren't already pressed by the hum
+ Returns the number of duty cycles up to SWEEP_REJECTED where the hum
+ holds the pad for more than SWEEP_MAX_HELD percent of the time: the
+ filter rejects that hum, FAST_ATTACK mustn't latch on it either. */
+template <class Kernel>
+int humSweep(const char * kernelName)
+{
+  int latched = 0;
+
+  printf("%s hum sweep:\n  duty  false presses/min  held %%  press latency ms\n", kernelName);
+
+  for (int duty=30; duty<=95; duty+=5)
+  {
+    long falsePresses = 0;
+    long heldSamples = 0;
+    for (int phase=0; phase<SWEEP_PHASES; phase++)
+    {
+      Kernel kernel;
+      kernelSide<Kernel> side;
+      bool pressed = false;
+      kernel.begin(SWITCH_THRESHOLD_OFFSET_PERC, SWITCH_THRESHOLD_CENTER_BIAS, COMB_PRESS_MARGIN_PERC);
+      kernel.reset(&side.state);
+      side.kernel = &kernel;
+      for (int n=0; n<SWEEP_SAMPLES; n++)
+      {
+        kernel.store(&side.state, humSample(n, duty, phase * 2));
+        kernel.sum(&side.state);
+        kernel.advance();
+        bool now = decide(side, pressed);
+        if (now && !pressed)
+        {
+          falsePresses++;
+        }
+        heldSamples += now;
+        pressed = now;
+      }
+    }
+
+    long latency = 0;
+    int touches = 0;
+    for (int trial=0; trial<SWEEP_TRIALS; trial++)
+    {
+      Kernel kernel;
+      kernelSide<Kernel> side;
+      bool pressed = false;
+      int phase = rand() % WINDOW_SAMPLES;
+      int start = 5 * WINDOW_SAMPLES + rand() % WINDOW_SAMPLES;
+      kernel.begin(SWITCH_THRESHOLD_OFFSET_PERC, SWITCH_THRESHOLD_CENTER_BIAS, COMB_PRESS_MARGIN_PERC);
+      kernel.reset(&side.state);
+      side.kernel = &kernel;
+      for (int n=0; n<start + 4 * WINDOW_SAMPLES; n++)
+      {
+        kernel.store(&side.state, (n < start) ? humSample(n, duty, phase) : 1);
+        kernel.sum(&side.state);
+        kernel.advance();
+        pressed = decide(side, pressed);
+        if ((n == start - 1) && pressed)
+        {
+          break;  // the hum already pressed it
+        }
+        if ((n >= start) && pressed)
+        {
+          latency += n - start + 1;
+          touches++;
+          break;
+        }
+      }
+    }
+
+    double minutes = (double) SWEEP_PHASES * SWEEP_SAMPLES / SAMPLE_RATE / 60;
+    double held = 100.0 * heldSamples / ((double) SWEEP_PHASES * SWEEP_SAMPLES);
+    printf("  %3d%%  %17.1f  %6.1f  ", duty, falsePresses / minutes, held);
+    if (touches)
+    {
+      printf("%16.1f\n", 1000.0 * latency / touches / SAMPLE_RATE);
+    }
+    else
+    {
+      printf("%16s\n", "-");
+    }
+    if ((duty <= SWEEP_REJECTED) && (held > SWEEP_MAX_HELD))
+    {
+      printf("  %d%% hum holds the pad down, the filter rejects it\n", duty);
+      latched++;
+    }
+  }
+  return latched;
+}
+
+int main(int argc, char ** argv)
+{
+  std::vector<stream> streams;
+  std::vector<std::string> names;
+
+  printf("FILTER_MODE %s, FAST_ATTACK %d, COMB_WINDOW %d\n",
+    (FILTER_MODE == FILTER_COMB) ? "FILTER_COMB" : "FILTER_WINDOW", FAST_ATTACK, COMB_WINDOW);
+
+  srand(1);
+  for (int i=0; i<RANDOM_STREAMS; i++)
+  {
+    streams.push_back(randomStream(RANDOM_SAMPLES));
+    names.push_back("random " + std::to_string(i));
+  }
+  for (int a=1; a<argc; a++)
+  {
+    stream s;
+    if (!readStream(argv[a], s))
+    {
+      printf("can't read %s\n", argv[a]);
+      return 1;
+    }
+    streams.push_back(s);
+    names.push_back(argv[a]);
+  }
+
+  // every kernel implementation goes through the same checks
+  int mismatches = 0;
+  mismatches += checkKernel<inputFilterClass>("inputFilterClass", streams, names);
+
+  benchmarkKernel<inputFilterClass>("inputFilterClass");
+  mismatches += humSweep<inputFilterClass>("inputFilterClass");
+
+  if (mismatches)
+  {
+    printf("FAILED\n");
+    return 1;
+  }
+  printf("OK\n");
+  return 0;
+}
@@ -0,0 +1,350 @@
+/*
+  rolloverTest.cpp
+
+ Host-side test of the held keys and keyboard reports in makeyMate.cpp,
+ built against the stand-ins in sim/. Every keyboard report the firmware
+ sends to the RN-42 is read back as the host would see it, and checked
+ against the rules in settings.h (ROLLOVER):
+ - no more than six keys, each one held
+ - priority keys first, oldest first, then the newest of the rest
+ - a key pushed out comes back as soon as there's room
+ - modifier keys only ever show up in the modifier byte
+ - shifted characters add shift while one of them is in the report, and
+   don't take it away from a held shift pad
+ - once every pad is let go, nothing is left down
+
+ The 18 pads are held down together in order, with and without priority
+ pads, and let go in either order. Then random presses and releases.
+ Exits with 1 if any report is wrong.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include "Arduino.h"
+#include "makeyMate.h"
+
+#define NUM_PADS       18
+#define RANDOM_STEPS   20000
+
+unsigned long simMillis = 0;
+std::vector<uint8_t> simTx;
+
+// a keyboard only layout: the key code each pad sends, the scan code the
+// host should see for it (0 for the modifiers), and whether it needs shift
+const uint8_t padKey[NUM_PADS] = {
+  KEY_UP_ARROW, KEY_DOWN_ARROW, KEY_LEFT_ARROW, KEY_RIGHT_ARROW, ' ', KEY_RIGHT_CTRL,
+  'w', 'a', 's', 'd', 'f', 'g',
+  'Q', '@', '3', 'B', KEY_LEFT_SHIFT, '%'
+};
+const uint8_t padScan[NUM_PADS] = {
+  0x52, 0x51, 0x50, 0x4f, 0x2c, 0,
+  0x1a, 0x04, 0x16, 0x07, 0x09, 0x0a,
+  0x14, 0x1f, 0x20, 0x05, 0, 0x22
+};
+const bool padShift[NUM_PADS] = {
+  false, false, false, false, false, false,
+  false, false, false, false, false, false,
+  true, true, false, true, false, true
+};
+
+///////////////////////////
+// HOST ///////////////////
+///////////////////////////
+/* What the host has been told, from the last keyboard report */
+struct host
+{
+  uint8_t modifiers;
+  uint8_t keys[6];
+  size_t read;  // bytes of simTx already read
+
+  /* Reads any new reports, returns 0 if one is malformed */
+  int update()
+  {
+    while (read < simTx.size())
+    {
+      if ((simTx[read] == 0xFE) && (read + 9 <= simTx.size()) && (simTx[read + 1] == 0x07))
+      {
+        modifiers = simTx[read + 2];
+        for (int j=0; j<6; j++)
+        {
+          keys[j] = simTx[read + 3 + j];
+        }
+        read += 9;
+      }
+      else if ((simTx[read] == 0xFD) && (read + 7 <= simTx.size()))
+      {
+        read += 7;
+      }
+      else
+      {
+        printf("  unexpected byte 0x%02x sent to the module\n", simTx[read]);
+        return 0;
+      }
+    }
+    return 1;
+  }
+
+  bool has(uint8_t scan) const
+  {
+    for (int j=0; j<6; j++)
+    {
+      if (keys[j] == scan)
+      {
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+///////////////////////////
+// MODEL //////////////////
+///////////////////////////
+/* The pads held down, oldest first, and the report settings.h says the
+ host should have for them */
+struct model
+{
+  std::vector<int> held;
+  bool priority[NUM_PADS];
+  unsigned int displaced;  // times a held key was pushed out of the report
+
+  // the pads whose keys go in the report
+  std::vector<int> chosen() const
+  {
+    std::vector<int> pads;
+    for (size_t i=0; (i<held.size()) && (pads.size()<6); i++)
+    {
+      if (padScan[held[i]] && priority[held[i]])
+      {
+        pads.push_back(held[i]);
+      }
+    }
+    for (int i=(int) held.size()-1; (i>=0) && (pads.size()<6); i--)
+    {
+      if (padScan[held[i]] && !priority[held[i]])
+      {
+        pads.push_back(held[i]);
+      }
+    }
+    return pads;
+  }
+
+  // the modifier pads held, plus shift for a shifted key in the report
+  uint8_t modifiers() const
+  {
+    uint8_t m = 0;
+    for (size_t i=0; i<held.size(); i++)
+    {
+      if (padKey[held[i]] >= 128 && padKey[held[i]] < 136)
+      {
+        m |= 1 << (padKey[held[i]] - 128);
+      }
+    }
+    std::vector<int> pads = chosen();
+    for (size_t i=0; i<pads.size(); i++)
+    {
+      if (padShift[pads[i]])
+      {
+        m |= 0x02;
+      }
+    }
+    return m;
+  }
+
+  std::vector<uint8_t> expected() const
+  {
+    std::vector<int> pads = chosen();
+    std::vector<uint8_t> keys;
+    for (size_t i=0; i<pads.size(); i++)
+    {
+      keys.push_back(padScan[pads[i]]);
+    }
+    return keys;
+  }
+};
+
+///////////////////////////
+// CHECKS /////////////////
+///////////////////////////
+/* Compares what the host has with the model, prints the first few
+ differences. Returns 0 if they differ. */
+int checkReport(const char * testName, int step, host & h, const model & m)
+{
+  static int printed = 0;
+  std::vector<uint8_t> keys = m.expected();
+  int used = 0;
+  bool same = (h.modifiers == m.modifiers());
+
+  for (int j=0; j<6; j++)
+  {
+    if (!h.keys[j])
+    {
+      continue;
+    }
+    used++;
+    for (int k=j+1; k<6; k++)
+    {
+      same = same && (h.keys[k] != h.keys[j]);  // no key twice
+    }
+  }
+  same = same && (used == (int) keys.size());
+  for (size_t i=0; i<keys.size(); i++)
+  {
+    same = same && h.has(keys[i]);
+  }
+
+  if (!same && (printed++ < 5))
+  {
+    printf("  %s, step %d: host has %02x [%02x %02x %02x %02x %02x %02x], expected %02x [",
+      testName, step, h.modifiers, h.keys[0], h.keys[1], h.keys[2], h.keys[3], h.keys[4], h.keys[5],
+      m.modifiers());
+    for (size_t i=0; i<keys.size(); i++)
+    {
+      printf(" %02x", keys[i]);
+    }
+    printf(" ]\n");
+  }
+  return same;
+}
+
+/* Presses or releases pad p, sends the report like the link task does,
+ and checks what the host ends up with */
+int step(const char * testName, int n, makeyMateClass & mate, host & h, model & m, int p, bool down)
+{
+  std::vector<uint8_t> before = m.expected();
+
+  if (down)
+  {
+    mate.keyPress(padKey[p], m.priority[p]);
+    m.held.push_back(p);
+  }
+  else
+  {
+    mate.keyRelease(padKey[p]);
+    for (size_t i=0; i<m.held.size(); i++)
+    {
+      if (m.held[i] == p)
+      {
+        m.held.erase(m.held.begin() + i);
+        break;
+      }
+    }
+  }
+
+  std::vector<uint8_t> after = m.expected();
+  for (size_t i=0; i<before.size(); i++)
+  {
+    bool kept = false;
+    for (size_t j=0; j<after.size(); j++)
+    {
+      kept = kept || (after[j] == before[i]);
+    }
+    if (!kept && !(!down && (before[i] == padScan[p])))
+    {
+      m.displaced++;  // still held, but the host sees it released
+    }
+  }
+
+  mate.sendReport();
+  simMillis += 10;
+  return h.update() && checkReport(testName, n, h, m);
+}
+
+/* Checks the firmware counted the same keys pushed out of the report
+ as the model. Returns 0 if it didn't. */
+int checkDisplaced(const char * testName, makeyMateClass & mate, const model & m)
+{
+  makeyMateStats stats = mate.getStats();
+  if (stats.displacedKeys != m.displaced)
+  {
+    printf("  %s: %u keys pushed out of the report, expected %u\n", testName, stats.displacedKeys, m.displaced);
+    return 0;
+  }
+  return 1;
+}
+
+/* Holds all 18 pads down one after another, then lets them go, newest
+ first or oldest first. Pads set in priorityMask get priority. Returns
+ the number of wrong reports. */
+int holdAllPads(const char * testName, unsigned long priorityMask, bool newestFirst)
+{
+  makeyMateClass mate;
+  host h = {0, {0, 0, 0, 0, 0, 0}, simTx.size()};
+  model m;
+  int failures = 0;
+  int n = 0;
+
+  m.displaced = 0;
+  for (int p=0; p<NUM_PADS; p++)
+  {
+    m.priority[p] = (priorityMask >> p) & 1;
+  }
+  for (int p=0; p<NUM_PADS; p++)
+  {
+    failures += !step(testName, n++, mate, h, m, p, true);
+  }
+
+  // 16 keys and 2 modifiers held, the host has six of the keys
+  failures += !checkDisplaced(testName, mate, m);
+
+  for (int r=0; r<NUM_PADS; r++)
+  {
+    failures += !step(testName, n++, mate, h, m, newestFirst ? NUM_PADS - 1 - r : r, false);
+  }
+  if (h.modifiers || h.keys[0] || h.keys[1] || h.keys[2] || h.keys[3] || h.keys[4] || h.keys[5])
+  {
+    printf("  %s: keys still down on the host after every pad was let go\n", testName);
+    failures++;
+  }
+
+  printf("%-32s %s\n", testName, failures ? "FAILED" : "ok");
+  return failures;
+}
+
+/* Random presses and releases of random pads, a quarter of them with
+ priority. Returns the number of wrong reports. */
+int randomPads(const char * testName)
+{
+  makeyMateClass mate;
+  host h = {0, {0, 0, 0, 0, 0, 0}, simTx.size()};
+  model m;
+  bool down[NUM_PADS] = {false};
+  int failures = 0;
+
+  m.displaced = 0;
+  for (int p=0; p<NUM_PADS; p++)
+  {
+    m.priority[p] = (rand() % 4) == 0;
+  }
+  for (int n=0; n<RANDOM_STEPS; n++)
+  {
+    int p = rand() % NUM_PADS;
+    failures += !step(testName, n, mate, h, m, p, !down[p]);
+    down[p] = !down[p];
+  }
+  failures += !checkDisplaced(testName, mate, m);
+
+  printf("%-32s %s\n", testName, failures ? "FAILED" : "ok");
+  return failures;
+}
+
+int main()
+{
+  int failures = 0;
+
+  srand(1);
+  failures += holdAllPads("all pads, newest let go first", 0, true);
+  failures += holdAllPads("all pads, oldest let go first", 0, false);
+  failures += holdAllPads("all pads, arrows with priority", 0x0000F, false);
+  failures += holdAllPads("all pads, seven with priority", 0x3F0C0, true);
+  failures += randomPads("random pads");
+
+  if (failures)
+  {
+    printf("FAILED\n");
+    return 1;
+  }
+  printf("OK\n");
+  return 0;
+}
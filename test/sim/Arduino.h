@@ -0,0 +1,58 @@
+/*
+  Arduino.h
+
+ Just enough of the Arduino core to build makeyMate.cpp and eventLog.cpp
+ on a PC. Time only moves when the test or delay() moves it.
+ */
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>  // before min() below, the C++ headers don't get along with it
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define PROGMEM
+#define pgm_read_byte(address)  (*(const uint8_t *)(address))
+#define min(a,b)  ((a)<(b)?(a):(b))
+
+// key codes from the Leonardo core's USBAPI.h
+#define KEY_LEFT_CTRL    0x80
+#define KEY_LEFT_SHIFT   0x81
+#define KEY_LEFT_ALT     0x82
+#define KEY_LEFT_GUI     0x83
+#define KEY_RIGHT_CTRL   0x84
+#define KEY_RIGHT_SHIFT  0x85
+#define KEY_RIGHT_ALT    0x86
+#define KEY_RIGHT_GUI    0x87
+#define KEY_UP_ARROW     0xDA
+#define KEY_DOWN_ARROW   0xD9
+#define KEY_LEFT_ARROW   0xD8
+#define KEY_RIGHT_ARROW  0xD7
+
+extern unsigned long simMillis;  // the simulated clock, defined by the test
+
+inline unsigned long millis() { return simMillis; }
+inline unsigned long micros() { return simMillis * 1000; }
+inline void delay(unsigned long ms) { simMillis += ms; }
+
+class Print
+{
+public:
+  virtual size_t write(uint8_t b) = 0;
+  size_t write(const uint8_t * buffer, size_t size)
+  {
+    for (size_t n=0; n<size; n++)
+    {
+      write(buffer[n]);
+    }
+    return size;
+  }
+};
+
+#endif	// Arduino_h
@@ -0,0 +1,45 @@
+/*
+  SoftwareSerial.h
+
+ Stands in for the RN-42's serial port on a PC. Everything the firmware
+ writes is kept in simTx for the test to read back, and the module never
+ answers.
+ */
+
+#ifndef SoftwareSerial_h
+#define SoftwareSerial_h
+
+#include <stdio.h>
+#include <vector>
+#include "Arduino.h"
+
+extern std::vector<uint8_t> simTx;  // bytes sent to the module, defined by the test
+
+class SoftwareSerial : public Print
+{
+public:
+  SoftwareSerial(uint8_t receivePin, uint8_t transmitPin) {}
+  void begin(long speed) {}
+  size_t write(uint8_t b) { simTx.push_back(b); return 1; }
+  size_t print(const char * s)
+  {
+    size_t n = 0;
+    while (s[n])
+    {
+      write((uint8_t) s[n++]);
+    }
+    return n;
+  }
+  size_t print(int value)
+  {
+    char text[8];
+    snprintf(text, sizeof(text), "%d", value);
+    return print(text);
+  }
+  int available() { return 0; }
+  int read() { return -1; }
+  int peek() { return -1; }
+  void flush() {}
+};
+
+#endif	// SoftwareSerial_h